@@ -0,0 +1,15 @@
+/*
+ * Stand-in for Python.h, so that the tree code can be built into the
+ * benchmark without Python. The tree code only needs the allocator.
+ */
+
+#ifndef _BENCH_PYTHON_H
+#define _BENCH_PYTHON_H
+
+#include <stdlib.h>
+
+#define PyMem_Malloc(n)		malloc((n) == 0 ? 1 : (n))
+#define PyMem_Realloc(p, n)	realloc((p), (n) == 0 ? 1 : (n))
+#define PyMem_Free(p)		free(p)
+
+#endif /* _BENCH_PYTHON_H */
@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2026 The py-radix contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Times the core tree operations of radix.c, without Python: insertion,
+ * exact and best-match searches, compiling and searching the compiled
+ * tables, and removal. Prefixes come from a synthetic workload or a file
+ * of one prefix per line. Results are printed as a table, or with -j as
+ * one JSON object per line.
+ */
+
+#include "Python.h"
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+#endif
+
+#include "radix.h"
+
+struct bench {
+	const char *workload;
+	int json;
+	int perf_fd;			/* cache miss counter, or -1 */
+	radix_tree_t *radix;
+};
+
+/* Share of prefixes of each length, in parts per thousand */
+struct lenmix {
+	u_int bitlen;
+	u_int share;
+};
+
+/* Roughly the IPv4 default-free zone */
+static const struct lenmix dfz4_mix[] = {
+	{ 8, 1 }, { 12, 2 }, { 14, 4 }, { 15, 6 }, { 16, 22 }, { 17, 10 },
+	{ 18, 16 }, { 19, 30 }, { 20, 50 }, { 21, 50 }, { 22, 120 },
+	{ 23, 100 }, { 24, 589 }, { 0, 0 }
+};
+
+/* Sparse IPv6: mostly /48s and /32s under a few hundred blocks */
+static const struct lenmix sparse6_mix[] = {
+	{ 29, 30 }, { 32, 180 }, { 36, 30 }, { 40, 50 }, { 44, 100 },
+	{ 46, 30 }, { 47, 30 }, { 48, 500 }, { 56, 30 }, { 64, 20 },
+	{ 0, 0 }
+};
+
+static u_int64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/* xorshift64*, so that runs are repeatable */
+static u_int64_t
+rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 0x2545f4914f6cdd1dULL);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: radix_bench [-j] [-n prefixes] "
+	    "[-q queries] [-s seed]\n"
+	    "           [-w dfz4|sparse6] [-f prefix-file]\n");
+	exit(1);
+}
+
+static void *
+xmalloc(size_t len)
+{
+	void *p;
+
+	if ((p = malloc(len)) == NULL) {
+		fprintf(stderr, "radix_bench: out of memory\n");
+		exit(1);
+	}
+	return (p);
+}
+
+static u_int
+pick_len(const struct lenmix *mix)
+{
+	u_int r = rng() % 1000, i;
+
+	for (i = 0; mix[i + 1].bitlen != 0; i++) {
+		if (r < mix[i].share)
+			break;
+		r -= mix[i].share;
+	}
+	return (mix[i].bitlen);
+}
+
+/* Clear the bits of an address past bitlen */
+static void
+mask_addr(u_char *addr, u_int bitlen, u_int maxbits)
+{
+	u_int i;
+
+	for (i = bitlen; i < maxbits; i++)
+		addr[i / 8] &= ~(0x80 >> (i % 8));
+}
+
+/*
+ * Synthetic prefixes, clustered in allocation blocks as real tables are:
+ * /12s in unicast IPv4 space, /20s in 2000::/4
+ */
+static prefix_t *
+gen_prefixes(const char *workload, size_t n)
+{
+	const struct lenmix *mix;
+	u_int32_t blocks[4096], w;
+	u_int64_t hi;
+	u_char addr[16];
+	prefix_t *prefixes;
+	size_t i;
+	int v6, j;
+
+	if (strcmp(workload, "dfz4") == 0)
+		v6 = 0;
+	else if (strcmp(workload, "sparse6") == 0)
+		v6 = 1;
+	else
+		usage();
+	mix = v6 ? sparse6_mix : dfz4_mix;
+	for (j = 0; j < 4096; j++) {
+		w = (u_int32_t)rng();
+		/* 1.0.0.0 - 223.255.255.255, or 2000::/4 */
+		blocks[j] = v6 ? (0x2000 << 4) | (w & 0xffff) :
+		    (1 + w % 223) << 4 | ((w >> 8) & 0xf);
+	}
+
+	prefixes = xmalloc(n * sizeof(*prefixes));
+	for (i = 0; i < n; i++) {
+		memset(addr, '\0', sizeof(addr));
+		if (v6) {
+			/* 20 bit block, then 44 random bits */
+			hi = ((u_int64_t)blocks[rng() % 256] << 44) |
+			    (rng() & 0xfffffffffffULL);
+			for (j = 0; j < 8; j++)
+				addr[j] = (u_char)(hi >> (56 - 8 * j));
+		} else {
+			w = (blocks[rng() % 4096] << 20) |
+			    ((u_int32_t)rng() & 0xfffff);
+			for (j = 0; j < 4; j++)
+				addr[j] = (u_char)(w >> (24 - 8 * j));
+		}
+		prefix_from_blob(addr, v6 ? 16 : 4, pick_len(mix),
+		    &prefixes[i]);
+		mask_addr((u_char *)&prefixes[i].add, prefixes[i].bitlen,
+		    v6 ? 128 : 32);
+	}
+	return (prefixes);
+}
+
+/* Prefixes of one family from a file; the first line sets the family */
+static prefix_t *
+read_prefixes(const char *path, size_t *np)
+{
+	char line[256], *cp;
+	const char *errmsg;
+	prefix_t *prefixes = NULL;
+	size_t n = 0, size = 0;
+	u_int family = 0;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "radix_bench: %s: %s\n", path,
+		    strerror(errno));
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if ((cp = strpbrk(line, " \t\r\n#")) != NULL)
+			*cp = '\0';
+		if (line[0] == '\0')
+			continue;
+		if (n == size) {
+			size = (size == 0) ? 65536 : size * 2;
+			if ((prefixes = realloc(prefixes,
+			    size * sizeof(*prefixes))) == NULL) {
+				fprintf(stderr, "radix_bench: out of memory\n");
+				exit(1);
+			}
+		}
+		if (prefix_pton(line, -1, &prefixes[n], &errmsg) == NULL) {
+			fprintf(stderr, "radix_bench: %s: %s\n", line,
+			    errmsg != NULL ? errmsg : "invalid prefix");
+			exit(1);
+		}
+		if (family == 0)
+			family = prefixes[n].family;
+		if (prefixes[n].family == family)
+			n++;
+	}
+	fclose(f);
+	*np = n;
+	return (prefixes);
+}
+
+/*
+ * Host addresses to search for: half under loaded prefixes, half drawn
+ * from anywhere in the prefixes' space
+ */
+static prefix_t *
+gen_queries(prefix_t *prefixes, size_t n, size_t nq)
+{
+	prefix_t *queries, *p;
+	u_char *addr;
+	u_int maxbits, i, bit;
+	size_t q;
+
+	queries = xmalloc(nq * sizeof(*queries));
+	for (q = 0; q < nq; q++) {
+		p = &prefixes[rng() % n];
+		maxbits = (p->family == AF_INET6) ? 128 : 32;
+		queries[q] = *p;
+		queries[q].bitlen = maxbits;
+		addr = (u_char *)&queries[q].add;
+		bit = (q % 2 == 0) ? p->bitlen : 8;
+		for (i = bit; i < maxbits; i++) {
+			if (rng() & 1)
+				addr[i / 8] ^= 0x80 >> (i % 8);
+		}
+	}
+	return (queries);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static int
+perf_open(void)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+
+	memset(&attr, '\0', sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return ((int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+	return (-1);
+#endif
+}
+
+static void
+perf_start(struct bench *b)
+{
+#ifdef __linux__
+	if (b->perf_fd != -1) {
+		ioctl(b->perf_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(b->perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+/* Cache misses since perf_start, or -1 if they cannot be counted */
+static long long
+perf_stop(struct bench *b)
+{
+	long long count = -1;
+
+#ifdef __linux__
+	if (b->perf_fd != -1) {
+		ioctl(b->perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(b->perf_fd, &count, sizeof(count)) != sizeof(count))
+			count = -1;
+	}
+#endif
+	return (count);
+}
+
+static void
+report(struct bench *b, const char *op, size_t n, double secs,
+    long long misses)
+{
+	double bytes;
+
+	bytes = (b->radix->num_prefixes == 0) ? 0.0 :
+	    (double)radix_memory(b->radix) / b->radix->num_prefixes;
+	if (b->json) {
+		printf("{\"workload\": \"%s\", \"op\": \"%s\", \"n\": %lu, "
+		    "\"ns_per_op\": %.1f, \"cache_misses_per_op\": ",
+		    b->workload, op, (unsigned long)n, secs * 1e9 / n);
+		if (misses >= 0)
+			printf("%.2f", (double)misses / n);
+		else
+			printf("null");
+		printf(", \"prefixes\": %d, \"bytes_per_prefix\": %.1f}\n",
+		    b->radix->num_prefixes, bytes);
+	} else {
+		printf("%-8s %-14s %9lu %10.1f ", b->workload, op,
+		    (unsigned long)n, secs * 1e9 / n);
+		if (misses >= 0)
+			printf("%12.2f", (double)misses / n);
+		else
+			printf("%12s", "-");
+		printf(" %9d %10.1f\n", b->radix->num_prefixes, bytes);
+	}
+	fflush(stdout);
+}
+
+#define TIMED(b, op, n, body) do { \
+	double t0; \
+	perf_start(b); \
+	t0 = now(); \
+	body; \
+	report((b), (op), (n), now() - t0, perf_stop(b)); \
+} while (0)
+
+int
+main(int argc, char **argv)
+{
+	struct bench b;
+	prefix_t *prefixes, *queries;
+	radix_node_t **nodes, *node;
+	const char *file = NULL;
+	size_t n = 500000, nq = 2000000, nnodes, i;
+	unsigned long found = 0;
+	int ch, r;
+
+	memset(&b, '\0', sizeof(b));
+	b.workload = "dfz4";
+	while ((ch = getopt(argc, argv, "f:hjn:q:s:w:")) != -1) {
+		switch (ch) {
+		case 'f':
+			file = optarg;
+			break;
+		case 'j':
+			b.json = 1;
+			break;
+		case 'n':
+			n = strtoul(optarg, NULL, 10);
+			break;
+		case 'q':
+			nq = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			rng_state = strtoull(optarg, NULL, 10) | 1;
+			break;
+		case 'w':
+			b.workload = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (file != NULL) {
+		prefixes = read_prefixes(file, &n);
+		b.workload = "file";
+	} else
+		prefixes = gen_prefixes(b.workload, n);
+	if (n == 0 || nq == 0)
+		usage();
+	queries = gen_queries(prefixes, n, nq);
+
+	b.perf_fd = perf_open();
+	if ((b.radix = New_Radix(prefixes[0].family)) == NULL) {
+		fprintf(stderr, "radix_bench: out of memory\n");
+		return (1);
+	}
+	if (!b.json)
+		printf("%-8s %-14s %9s %10s %12s %9s %10s\n", "workload",
+		    "op", "n", "ns/op", "misses/op", "prefixes",
+		    "bytes/pfx");
+
+	TIMED(&b, "insert", n,
+	    for (i = 0; i < n; i++) {
+		if (radix_lookup(b.radix, &prefixes[i]) == NULL) {
+			fprintf(stderr, "radix_bench: out of memory\n");
+			return (1);
+		}
+	    });
+	TIMED(&b, "search_exact", n,
+	    for (i = 0; i < n; i++)
+		found += radix_search_exact(b.radix, &prefixes[i]) != NULL);
+	TIMED(&b, "search_best", nq,
+	    for (i = 0; i < nq; i++)
+		found += radix_search_best(b.radix, &queries[i]) != NULL);
+
+	if (b.radix->maxbits == 32) {
+		TIMED(&b, "compile", 1, r = radix_dir24_compile(b.radix));
+	} else
+		TIMED(&b, "compile", 1, r = radix_poptrie_compile(b.radix));
+	if (r == 0) {
+		TIMED(&b, "search_compiled", nq,
+		    for (i = 0; i < nq; i++)
+			found += radix_search_best(b.radix,
+			    &queries[i]) != NULL);
+	}
+
+	/* Time removal from the plain tree, as insertion was */
+	if (b.radix->dir24 != NULL)
+		radix_dir24_free(b.radix);
+	if (b.radix->poptrie != NULL)
+		radix_poptrie_free(b.radix);
+
+	/* Each prefix once, marking nodes already listed */
+	nodes = xmalloc(n * sizeof(*nodes));
+	nnodes = 0;
+	for (i = 0; i < n; i++) {
+		node = radix_search_exact(b.radix, &prefixes[i]);
+		if (node != NULL && node->data == NULL) {
+			node->data = node;
+			nodes[nnodes++] = node;
+		}
+	}
+	TIMED(&b, "remove", nnodes,
+	    for (i = 0; i < nnodes; i++)
+		radix_remove(b.radix, nodes[i]));
+
+	/* Keep the searches from being optimised away */
+	if (found == 0)
+		fprintf(stderr, "radix_bench: nothing found\n");
+	Destroy_Radix(b.radix, NULL, NULL);
+	free(nodes);
+	free(queries);
+	free(prefixes);
+	return (0);
+}
@@ -58,6 +58,7 @@
 #include "Python.h"
 
 #include <sys/types.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -97,66 +98,199 @@ comp_with_mask(u_char *addr, u_char *dest, u_int mask)
 	return (0);
 }
 
+/*
+ * Addresses as big-endian words, so that prefixes can be compared a word
+ * at a time under a mask
+ */
+#if defined(WORDS_BIGENDIAN)
+# define RADIX_BE32(x)	(x)
+# define RADIX_BE64(x)	(x)
+#elif defined(__GNUC__)
+# define RADIX_BE32(x)	__builtin_bswap32(x)
+# define RADIX_BE64(x)	__builtin_bswap64(x)
+#else
+static u_int32_t
+RADIX_BE32(u_int32_t x)
+{
+	return ((x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) |
+	    (x << 24));
+}
+
+static u_int64_t
+RADIX_BE64(u_int64_t x)
+{
+	return (((u_int64_t)RADIX_BE32((u_int32_t)x) << 32) |
+	    RADIX_BE32((u_int32_t)(x >> 32)));
+}
+#endif
+
+/* The first "bits" bits of a word; 0 < bits <= word size */
+#define MASK32(bits)	(~(u_int32_t)0 << (32 - (bits)))
+#define MASK64(bits)	(~(u_int64_t)0 << (64 - (bits)))
+
+static u_int32_t
+load32(const u_char *p)
+{
+	u_int32_t w;
+
+	memcpy(&w, p, sizeof(w));
+	return (RADIX_BE32(w));
+}
+
+static u_int64_t
+load64(const u_char *p)
+{
+	u_int64_t w;
+
+	memcpy(&w, p, sizeof(w));
+	return (RADIX_BE64(w));
+}
+
 static prefix_t 
 *New_Prefix2(int family, void *dest, int bitlen, prefix_t *prefix)
 {
-	int dynamic_allocated = 0;
 	int default_bitlen = 32;
 
 	if (family == AF_INET6) {
 		default_bitlen = 128;
-		if (prefix == NULL) {
-			if ((prefix = PyMem_Malloc(sizeof(*prefix))) == NULL)
-				return (NULL);
-			memset(prefix, '\0', sizeof(*prefix));
-			dynamic_allocated++;
-		}
 		memcpy(&prefix->add.sin6, dest, 16);
 	} else if (family == AF_INET) {
-		if (prefix == NULL) {
-			if ((prefix = PyMem_Malloc(sizeof(*prefix))) == NULL)
-				return (NULL);
-			memset(prefix, '\0', sizeof(*prefix));
-			dynamic_allocated++;
-		}
+		memset(&prefix->add, '\0', sizeof(prefix->add));
 		memcpy(&prefix->add.sin, dest, 4);
 	} else
 		return (NULL);
 
 	prefix->bitlen = (bitlen >= 0) ? bitlen : default_bitlen;
 	prefix->family = family;
-	prefix->ref_count = 0;
-	if (dynamic_allocated)
-		prefix->ref_count++;
 	return (prefix);
 }
 
+/*
+ * Slab allocator. Nodes are carved out of chunks owned by the tree, so
+ * that neighbouring nodes tend to share cache lines, and
+ * are recycled through a per-slab free list. Chunks start small and grow
+ * geometrically so that tiny trees stay tiny. Destroying a tree releases
+ * the chunks wholesale instead of freeing each object.
+ */
+#define RADIX_SLAB_MIN		16	/* objects in the first chunk */
+#define RADIX_SLAB_MAX		4096	/* cap on objects per chunk */
+#define RADIX_CHUNK_HDR		16	/* chunk link, keeps objects aligned */
 
-static prefix_t 
-*Ref_Prefix(prefix_t *prefix)
+static void
+slab_init(radix_slab_t *slab, size_t objsize)
 {
-	if (prefix == NULL)
-		return (NULL);
-	if (prefix->ref_count == 0) {
-		/* make a copy in case of a static prefix */
-		return (New_Prefix2(prefix->family, &prefix->add,
-		    prefix->bitlen, NULL));
+	memset(slab, '\0', sizeof(*slab));
+	/* Free objects store the list link in place */
+	if (objsize < sizeof(void *))
+		objsize = sizeof(void *);
+	slab->objsize = (objsize + sizeof(void *) - 1) &
+	    ~(sizeof(void *) - 1);
+	slab->nextsize = RADIX_SLAB_MIN;
+}
+
+static void *
+slab_alloc(radix_slab_t *slab)
+{
+	void *obj, **chunk;
+
+	if ((obj = slab->freelist) != NULL) {
+		slab->freelist = *(void **)obj;
+		return (obj);
 	}
-	prefix->ref_count++;
-	return (prefix);
+	if (slab->navail == 0) {
+		chunk = PyMem_Malloc(RADIX_CHUNK_HDR +
+		    slab->nextsize * slab->objsize);
+		if (chunk == NULL)
+			return (NULL);
+		slab->allocated += RADIX_CHUNK_HDR +
+		    slab->nextsize * slab->objsize;
+		*chunk = slab->chunks;
+		slab->chunks = chunk;
+		slab->avail = (u_char *)chunk + RADIX_CHUNK_HDR;
+		slab->navail = slab->nextsize;
+		if (slab->nextsize < RADIX_SLAB_MAX)
+			slab->nextsize *= 2;
+	}
+	obj = slab->avail;
+	slab->avail += slab->objsize;
+	slab->navail--;
+	return (obj);
 }
 
+static void
+slab_free(radix_slab_t *slab, void *obj)
+{
+	*(void **)obj = slab->freelist;
+	slab->freelist = obj;
+}
 
-void
-Deref_Prefix(prefix_t *prefix)
+static void
+slab_release(radix_slab_t *slab)
 {
-	if (prefix == NULL)
-		return;
-	prefix->ref_count--;
-	if (prefix->ref_count <= 0) {
-		PyMem_Free(prefix);
-		return;
+	void **chunk, **next;
+
+	for (chunk = slab->chunks; chunk != NULL; chunk = next) {
+		next = *chunk;
+		PyMem_Free(chunk);
+	}
+	slab_init(slab, slab->objsize);
+}
+
+#ifdef RADIX_STATS
+# define RADIX_STAT(radix, field)	((radix)->stats.field++)
+# define RADIX_STEPS_DECL		u_int steps = 0
+# define RADIX_STEP()			(steps++)
+# define RADIX_STEPS_DONE(radix)	radix_stat_walk((radix), steps)
+
+static void
+radix_stat_walk(radix_tree_t *radix, u_int steps)
+{
+	radix->stats.walks++;
+	radix->stats.walk_steps += steps;
+	if (steps > radix->stats.max_walk_steps)
+		radix->stats.max_walk_steps = steps;
+}
+#else
+# define RADIX_STAT(radix, field)	do { } while (0)
+# define RADIX_STEPS_DECL
+# define RADIX_STEP()			do { } while (0)
+# define RADIX_STEPS_DONE(radix)	do { } while (0)
+#endif
+
+/* Node size, including the inline address for the tree's family */
+#define RADIX_NODE_SIZE(radix) \
+	(offsetof(radix_node_t, add) + (radix)->maxbits / 8)
+
+static radix_node_t *
+radix_new_node(radix_tree_t *radix, u_int bit, prefix_t *prefix)
+{
+	radix_node_t *node;
+
+	if ((node = slab_alloc(&radix->node_slab)) == NULL)
+		return (NULL);
+	memset(node, '\0', RADIX_NODE_SIZE(radix));
+	node->bit = bit;
+	if (prefix != NULL) {
+		node->family = prefix->family;
+		memcpy(node->add, prefix_touchar(prefix), radix->maxbits / 8);
 	}
+	radix->num_active_node++;
+	return (node);
+}
+
+static void
+radix_free_node(radix_tree_t *radix, radix_node_t *node)
+{
+	slab_free(&radix->node_slab, node);
+	radix->num_active_node--;
+}
+
+prefix_t *
+radix_node_prefix(radix_node_t *node, prefix_t *prefix)
+{
+	if (!RADIX_HAS_PREFIX(node))
+		return (NULL);
+	return (New_Prefix2(node->family, node->add, node->bit, prefix));
 }
 
 /*
@@ -167,7 +301,7 @@ Deref_Prefix(prefix_t *prefix)
 /* these routines support continuous mask only */
 
 radix_tree_t
-*New_Radix(void)
+*New_Radix(int family)
 {
 	radix_tree_t *radix;
 
@@ -175,9 +309,10 @@ radix_tree_t
 		return (NULL);
 	memset(radix, '\0', sizeof(*radix));
 
-	radix->maxbits = 128;
+	radix->maxbits = (family == AF_INET) ? 32 : 128;
 	radix->head = NULL;
 	radix->num_active_node = 0;
+	slab_init(&radix->node_slab, RADIX_NODE_SIZE(radix));
 	return (radix);
 }
 
@@ -188,36 +323,23 @@ radix_tree_t
 static void
 Clear_Radix(radix_tree_t *radix, rdx_cb_t func, void *cbctx)
 {
-	if (radix->head) {
-		radix_node_t *Xstack[RADIX_MAXBITS + 1];
-		radix_node_t **Xsp = Xstack;
-		radix_node_t *Xrn = radix->head;
-
-		while (Xrn) {
-			radix_node_t *l = Xrn->l;
-			radix_node_t *r = Xrn->r;
+	radix_node_t *node;
 
-			if (Xrn->prefix) {
-				Deref_Prefix(Xrn->prefix);
-				if (Xrn->data && func)
-					func(Xrn, cbctx);
-			}
-			PyMem_Free(Xrn);
-			radix->num_active_node--;
-
-			if (l) {
-				if (r)
-					*Xsp++ = r;
-				Xrn = l;
-			} else if (r) {
-				Xrn = r;
-			} else if (Xsp != Xstack) {
-				Xrn = *(--Xsp);
-			} else {
-				Xrn = (radix_node_t *) 0;
-			}
-		}
+	if (func != NULL) {
+		RADIX_WALK(radix->head, node) {
+			if (node->data)
+				func(node, cbctx);
+		} RADIX_WALK_END;
 	}
+	if (radix->dir24 != NULL)
+		radix_dir24_free(radix);
+	if (radix->poptrie != NULL)
+		radix_poptrie_free(radix);
+	/* Nodes all live in the slab */
+	slab_release(&radix->node_slab);
+	radix->head = NULL;
+	radix->num_active_node = 0;
+	radix->num_prefixes = 0;
 }
 
 void
@@ -228,7 +350,7 @@ Destroy_Radix(radix_tree_t *radix, rdx_cb_t func, void *cbctx)
 }
 
 /*
- * if func is supplied, it will be called as func(node->prefix, node->data)
+ * if func is supplied, it will be called as func(node, cbctx)
  */
 void
 radix_process(radix_tree_t *radix, rdx_cb_t func, void *cbctx)
@@ -247,6 +369,7 @@ radix_node_t
 	u_char *addr;
 	u_int bitlen;
 
+	RADIX_STAT(radix, exact_searches);
 	if (radix->head == NULL)
 		return (NULL);
 
@@ -264,97 +387,390 @@ radix_node_t
 			return (NULL);
 	}
 
-	if (node->bit > bitlen || node->prefix == NULL)
+	if (node->bit > bitlen || !RADIX_HAS_PREFIX(node))
 		return (NULL);
 
-	if (comp_with_mask(prefix_tochar(node->prefix),
-	    prefix_tochar(prefix), bitlen))
+	if (comp_with_mask(node->add, addr, bitlen))
 		return (node);
 
 	return (NULL);
 }
 
 
+/*
+ * The best match is the last prefix on the path down to the address that
+ * covers it. A prefix covers all those below it, so the walk stops at the
+ * first prefix that does not match.
+ */
+static radix_node_t
+*radix_search_best4(radix_tree_t *radix, prefix_t *prefix, int inclusive)
+{
+	radix_node_t *node, *best = NULL;
+	u_int32_t addr;
+	u_int bitlen;
+	RADIX_STEPS_DECL;
+
+	addr = load32(prefix_touchar(prefix));
+	bitlen = prefix->bitlen;
+
+	node = radix->head;
+	while (node != NULL && node->bit < bitlen) {
+		RADIX_STEP();
+		if (RADIX_HAS_PREFIX(node)) {
+			if (node->bit != 0 && ((addr ^ load32(node->add)) &
+			    MASK32(node->bit)) != 0) {
+				RADIX_STEPS_DONE(radix);
+				return (best);
+			}
+			best = node;
+		}
+		if (addr & (0x80000000U >> node->bit))
+			node = node->r;
+		else
+			node = node->l;
+	}
+
+	if (inclusive && node != NULL && node->bit == bitlen &&
+	    RADIX_HAS_PREFIX(node) && (bitlen == 0 ||
+	    ((addr ^ load32(node->add)) & MASK32(bitlen)) == 0))
+		best = node;
+	RADIX_STEPS_DONE(radix);
+	return (best);
+}
+
+/* Whether a node's prefix covers an address, whose first "done" bits match */
+static int
+match6(radix_node_t *node, u_int64_t hi, u_int64_t lo, u_int done)
+{
+	if (node->bit == 0)
+		return (1);
+	if (node->bit <= 64)
+		return (((hi ^ load64(node->add)) & MASK64(node->bit)) == 0);
+	if (done < 64 && hi != load64(node->add))
+		return (0);
+	return (((lo ^ load64(node->add + 8)) & MASK64(node->bit - 64)) == 0);
+}
+
+static radix_node_t
+*radix_search_best6(radix_tree_t *radix, prefix_t *prefix, int inclusive)
+{
+	radix_node_t *node, *best = NULL;
+	u_int64_t hi, lo, w;
+	u_int bitlen, done = 0;
+	RADIX_STEPS_DECL;
+
+	hi = load64(prefix_touchar(prefix));
+	lo = load64(prefix_touchar(prefix) + 8);
+	bitlen = prefix->bitlen;
+
+	node = radix->head;
+	while (node != NULL && node->bit < bitlen) {
+		RADIX_STEP();
+		if (RADIX_HAS_PREFIX(node)) {
+			if (!match6(node, hi, lo, done)) {
+				RADIX_STEPS_DONE(radix);
+				return (best);
+			}
+			best = node;
+			done = node->bit;
+		}
+		w = (node->bit < 64) ? hi : lo;
+		if (w & ((u_int64_t)1 << (63 - (node->bit & 63))))
+			node = node->r;
+		else
+			node = node->l;
+	}
+
+	if (inclusive && node != NULL && node->bit == bitlen &&
+	    RADIX_HAS_PREFIX(node) && match6(node, hi, lo, done))
+		best = node;
+	RADIX_STEPS_DONE(radix);
+	return (best);
+}
+
 /* if inclusive != 0, "best" may be the given prefix itself */
 static radix_node_t
 *radix_search_best2(radix_tree_t *radix, prefix_t *prefix, int inclusive)
+{
+	if (radix->maxbits == 32)
+		return (radix_search_best4(radix, prefix, inclusive));
+	return (radix_search_best6(radix, prefix, inclusive));
+}
+
+
+radix_node_t
+*radix_search_best(radix_tree_t *radix, prefix_t *prefix)
 {
 	radix_node_t *node;
-	radix_node_t *stack[RADIX_MAXBITS + 1];
+
+	RADIX_STAT(radix, best_searches);
+	/* Host lookups in a compiled tree need no walk */
+	if (radix->dir24 != NULL && prefix->bitlen == 32)
+		return (radix_dir24_lookup(radix->dir24, prefix_touchar(prefix)));
+	if (radix->poptrie != NULL && prefix->bitlen == 128 &&
+	    radix_poptrie_lookup(radix->poptrie, prefix_touchar(prefix),
+	    &node) == 0)
+		return (node);
+	return (radix_search_best2(radix, prefix, 1));
+}
+
+
+/* Keep the prefix count and any compiled table in step with the tree */
+static void
+radix_prefix_added(radix_tree_t *radix, radix_node_t *node)
+{
+	radix->num_prefixes++;
+	if (radix->dir24 != NULL)
+		radix_dir24_add(radix, node);
+	if (radix->poptrie != NULL)
+		radix_poptrie_invalidate(radix);
+}
+
+static void
+radix_prefix_removed(radix_tree_t *radix, radix_node_t *node)
+{
+	if (!RADIX_HAS_PREFIX(node))
+		return;
+	radix->num_prefixes--;
+	if (radix->dir24 != NULL)
+		radix_dir24_remove(radix, node);
+	if (radix->poptrie != NULL)
+		radix_poptrie_invalidate(radix);
+}
+
+/* Leading zero bits of a non-zero word */
+#if defined(__GNUC__)
+# define clz32(x)	((u_int)__builtin_clz(x))
+# define clz64(x)	((u_int)__builtin_clzll(x))
+#else
+static u_int
+clz32(u_int32_t x)
+{
+	u_int n = 0;
+
+	if ((x & 0xffff0000U) == 0) {
+		n += 16;
+		x <<= 16;
+	}
+	if ((x & 0xff000000U) == 0) {
+		n += 8;
+		x <<= 8;
+	}
+	if ((x & 0xf0000000U) == 0) {
+		n += 4;
+		x <<= 4;
+	}
+	if ((x & 0xc0000000U) == 0) {
+		n += 2;
+		x <<= 2;
+	}
+	if ((x & 0x80000000U) == 0)
+		n++;
+	return (n);
+}
+
+static u_int
+clz64(u_int64_t x)
+{
+	if ((x >> 32) != 0)
+		return (clz32((u_int32_t)(x >> 32)));
+	return (32 + clz32((u_int32_t)x));
+}
+#endif
+
+/*
+ * Returns the first bit at which two addresses differ, at most maxbit.
+ * Up to 32 bits are compared as one word, so IPv4 addresses (4 bytes)
+ * are never read past; longer compares are of IPv6 addresses.
+ */
+static u_int
+first_diff_bit(u_char *a, u_char *b, u_int maxbit)
+{
+	u_int32_t x;
+	u_int64_t y;
+	u_int i, differ_bit;
+
+	if (maxbit <= 32) {
+		x = load32(a) ^ load32(b);
+		differ_bit = (x != 0) ? clz32(x) : 32;
+	} else {
+		differ_bit = 128;
+		for (i = 0; i * 8 < maxbit; i += 8) {
+			if ((y = load64(a + i) ^ load64(b + i)) != 0) {
+				differ_bit = i * 8 + clz64(y);
+				break;
+			}
+		}
+	}
+	return (differ_bit < maxbit ? differ_bit : maxbit);
+}
+
+/*
+ * Returns the top of the subtree holding every prefix covered by "prefix",
+ * itself included, or NULL if there are none. Walk it with RADIX_WALK.
+ */
+radix_node_t
+*radix_search_subtree(radix_tree_t *radix, prefix_t *prefix)
+{
+	radix_node_t *node, *leaf;
 	u_char *addr;
 	u_int bitlen;
-	int cnt = 0;
-
-	if (radix->head == NULL)
-		return (NULL);
 
-	node = radix->head;
 	addr = prefix_touchar(prefix);
 	bitlen = prefix->bitlen;
-
-	while (node->bit < bitlen) {
-		if (node->prefix)
-			stack[cnt++] = node;
+	node = radix->head;
+	while (node != NULL && node->bit < bitlen) {
 		if (BIT_TEST(addr[node->bit >> 3], 0x80 >> (node->bit & 0x07)))
 			node = node->r;
 		else
 			node = node->l;
-
-		if (node == NULL)
-			break;
 	}
+	if (node == NULL)
+		return (NULL);
 
-	if (inclusive && node && node->prefix)
-		stack[cnt++] = node;
+	/* The prefixes below all share the node's leading bits; check one */
+	for (leaf = node; !RADIX_HAS_PREFIX(leaf);
+	    leaf = (leaf->l != NULL) ? leaf->l : leaf->r)
+		;
+	if (first_diff_bit(addr, leaf->add, bitlen) < bitlen)
+		return (NULL);
+	return (node);
+}
 
+/* Bytes allocated for the tree and its compiled table, if any */
+size_t
+radix_memory(radix_tree_t *radix)
+{
+	size_t len = sizeof(*radix) + radix->node_slab.allocated;
 
-	if (cnt <= 0)
-		return (NULL);
+	if (radix->dir24 != NULL)
+		len += radix_dir24_memory(radix->dir24);
+	if (radix->poptrie != NULL)
+		len += radix_poptrie_memory(radix->poptrie);
+	return (len);
+}
 
-	while (--cnt >= 0) {
-		node = stack[cnt];
-		if (comp_with_mask(prefix_tochar(node->prefix),
-		    prefix_tochar(prefix), node->prefix->bitlen) &&
-		    node->prefix->bitlen <= bitlen)
-			return (node);
+/*
+ * Counts the prefixes at each depth (nodes above them, glue included) in
+ * depths[0..RADIX_MAXBITS]
+ */
+void
+radix_depths(radix_tree_t *radix, u_int *depths)
+{
+	struct {
+		radix_node_t *node;
+		u_int depth;
+	} stack[RADIX_MAXBITS + 1], *sp = stack;
+	radix_node_t *node = radix->head;
+	u_int depth = 0;
+
+	memset(depths, '\0', (RADIX_MAXBITS + 1) * sizeof(*depths));
+	while (node != NULL) {
+		if (RADIX_HAS_PREFIX(node))
+			depths[depth]++;
+		if (node->l != NULL) {
+			if (node->r != NULL) {
+				sp->node = node->r;
+				sp->depth = depth + 1;
+				sp++;
+			}
+			node = node->l;
+			depth++;
+		} else if (node->r != NULL) {
+			node = node->r;
+			depth++;
+		} else if (sp != stack) {
+			sp--;
+			node = sp->node;
+			depth = sp->depth;
+		} else
+			node = NULL;
 	}
-	return (NULL);
 }
 
+/*
+ * Fills "nodes" with the prefixes that cover "prefix", shortest first, and
+ * returns how many there are, at most RADIX_MAXBITS + 1. They all lie on
+ * the path down to the prefix, which is left out unless "inclusive".
+ */
+int
+radix_search_covering(radix_tree_t *radix, prefix_t *prefix, int inclusive,
+    radix_node_t **nodes)
+{
+	radix_node_t *node;
+	u_char *addr;
+	u_int bitlen;
+	int n = 0;
+
+	addr = prefix_touchar(prefix);
+	bitlen = prefix->bitlen;
+	node = radix->head;
+	while (node != NULL && (node->bit < bitlen ||
+	    (inclusive && node->bit == bitlen))) {
+		if (RADIX_HAS_PREFIX(node)) {
+			/* A prefix covers all those below it */
+			if (first_diff_bit(addr, node->add, node->bit) <
+			    node->bit)
+				break;
+			nodes[n++] = node;
+		}
+		if (node->bit == bitlen)
+			break;
+		if (BIT_TEST(addr[node->bit >> 3], 0x80 >> (node->bit & 0x07)))
+			node = node->r;
+		else
+			node = node->l;
+	}
+	return (n);
+}
 
 radix_node_t
-*radix_search_best(radix_tree_t *radix, prefix_t *prefix)
+*radix_lookup(radix_tree_t *radix, prefix_t *prefix)
 {
-	return (radix_search_best2(radix, prefix, 1));
+	return (radix_lookup_hint(radix, prefix, NULL));
 }
 
-
+/*
+ * As radix_lookup, but if "hint" is a node in the tree (typically the
+ * one returned by the previous insertion) then the descent starts from
+ * its deepest ancestor that must also lie on the path to "prefix", rather
+ * than from the head. This makes loading sorted prefixes cheaper.
+ */
 radix_node_t
-*radix_lookup(radix_tree_t *radix, prefix_t *prefix)
+*radix_lookup_hint(radix_tree_t *radix, prefix_t *prefix, radix_node_t *hint)
 {
 	radix_node_t *node, *new_node, *parent, *glue;
 	u_char *addr, *test_addr;
 	u_int bitlen, check_bit, differ_bit;
-	u_int i, j, r;
 
+	RADIX_STAT(radix, lookups);
 	if (radix->head == NULL) {
-		if ((node = PyMem_Malloc(sizeof(*node))) == NULL)
+		if ((node = radix_new_node(radix, prefix->bitlen,
+		    prefix)) == NULL)
 			return (NULL);
-		memset(node, '\0', sizeof(*node));
-		node->bit = prefix->bitlen;
-		node->prefix = Ref_Prefix(prefix);
-		node->parent = NULL;
-		node->l = node->r = NULL;
-		node->data = NULL;
 		radix->head = node;
-		radix->num_active_node++;
+		radix_prefix_added(radix, node);
 		return (node);
 	}
 	addr = prefix_touchar(prefix);
 	bitlen = prefix->bitlen;
 	node = radix->head;
 
-	while (node->bit < bitlen || node->prefix == NULL) {
+	if (hint != NULL && RADIX_HAS_PREFIX(hint)) {
+		/*
+		 * Every node above the hint whose bit is within the leading
+		 * bits shared by the hint and the prefix would be passed on
+		 * the way down from the head.
+		 */
+		check_bit = (hint->bit < bitlen) ? hint->bit : bitlen;
+		differ_bit = first_diff_bit(addr, hint->add, check_bit);
+		while (hint != NULL && hint->bit > differ_bit)
+			hint = hint->parent;
+		if (hint != NULL)
+			node = hint;
+	}
+
+	while (node->bit < bitlen || !RADIX_HAS_PREFIX(node)) {
 		if (node->bit < radix->maxbits && BIT_TEST(addr[node->bit >> 3],
 		    0x80 >> (node->bit & 0x07))) {
 			if (node->r == NULL)
@@ -367,26 +783,10 @@ radix_node_t
 		}
 	}
 
-	test_addr = prefix_touchar(node->prefix);
+	test_addr = node->add;
 	/* find the first bit different */
 	check_bit = (node->bit < bitlen) ? node->bit : bitlen;
-	differ_bit = 0;
-	for (i = 0; i * 8 < check_bit; i++) {
-		if ((r = (addr[i] ^ test_addr[i])) == 0) {
-			differ_bit = (i + 1) * 8;
-			continue;
-		}
-		/* I know the better way, but for now */
-		for (j = 0; j < 8; j++) {
-			if (BIT_TEST(r, (0x80 >> j)))
-				break;
-		}
-		/* must be found */
-		differ_bit = i * 8 + j;
-		break;
-	}
-	if (differ_bit > check_bit)
-		differ_bit = check_bit;
+	differ_bit = first_diff_bit(addr, test_addr, check_bit);
 
 	parent = node->parent;
 	while (parent && parent->bit >= differ_bit) {
@@ -395,19 +795,15 @@ radix_node_t
 	}
 
 	if (differ_bit == bitlen && node->bit == bitlen) {
-		if (node->prefix == NULL)
-			node->prefix = Ref_Prefix(prefix);
+		if (!RADIX_HAS_PREFIX(node)) {
+			node->family = prefix->family;
+			memcpy(node->add, addr, radix->maxbits / 8);
+			radix_prefix_added(radix, node);
+		}
 		return (node);
 	}
-	if ((new_node = PyMem_Malloc(sizeof(*new_node))) == NULL)
+	if ((new_node = radix_new_node(radix, prefix->bitlen, prefix)) == NULL)
 		return (NULL);
-	memset(new_node, '\0', sizeof(*new_node));
-	new_node->bit = prefix->bitlen;
-	new_node->prefix = Ref_Prefix(prefix);
-	new_node->parent = NULL;
-	new_node->l = new_node->r = NULL;
-	new_node->data = NULL;
-	radix->num_active_node++;
 
 	if (node->bit == differ_bit) {
 		new_node->parent = node;
@@ -417,6 +813,7 @@ radix_node_t
 		else
 			node->l = new_node;
 
+		radix_prefix_added(radix, new_node);
 		return (new_node);
 	}
 	if (bitlen == differ_bit) {
@@ -436,14 +833,11 @@ radix_node_t
 
 		node->parent = new_node;
 	} else {
-		if ((glue = PyMem_Malloc(sizeof(*glue))) == NULL)
+		if ((glue = radix_new_node(radix, differ_bit, NULL)) == NULL) {
+			radix_free_node(radix, new_node);
 			return (NULL);
-		memset(glue, '\0', sizeof(*glue));
-		glue->bit = differ_bit;
-		glue->prefix = NULL;
+		}
 		glue->parent = node->parent;
-		glue->data = NULL;
-		radix->num_active_node++;
 		if (differ_bit < radix->maxbits &&
 		    BIT_TEST(addr[differ_bit >> 3],
 		    0x80 >> (differ_bit & 0x07))) {
@@ -464,6 +858,7 @@ radix_node_t
 
 		node->parent = glue;
 	}
+	radix_prefix_added(radix, new_node);
 	return (new_node);
 }
 
@@ -473,23 +868,22 @@ radix_remove(radix_tree_t *radix, radix_node_t *node)
 {
 	radix_node_t *parent, *child;
 
+	RADIX_STAT(radix, removes);
+	radix_prefix_removed(radix, node);
+
 	if (node->r && node->l) {
 		/*
 		 * this might be a placeholder node -- have to check and make
 		 * sure there is a prefix aossciated with it !
 		 */
-		if (node->prefix != NULL)
-			Deref_Prefix(node->prefix);
-		node->prefix = NULL;
+		node->family = 0;
 		/* Also I needed to clear data pointer -- masaki */
 		node->data = NULL;
 		return;
 	}
 	if (node->r == NULL && node->l == NULL) {
 		parent = node->parent;
-		Deref_Prefix(node->prefix);
-		PyMem_Free(node);
-		radix->num_active_node--;
+		radix_free_node(radix, node);
 
 		if (parent == NULL) {
 			radix->head = NULL;
@@ -503,7 +897,7 @@ radix_remove(radix_tree_t *radix, radix_node_t *node)
 			child = parent->r;
 		}
 
-		if (parent->prefix)
+		if (RADIX_HAS_PREFIX(parent))
 			return;
 
 		/* we need to remove parent too */
@@ -515,8 +909,7 @@ radix_remove(radix_tree_t *radix, radix_node_t *node)
 			parent->parent->l = child;
 
 		child->parent = parent->parent;
-		PyMem_Free(parent);
-		radix->num_active_node--;
+		radix_free_node(radix, parent);
 		return;
 	}
 	if (node->r)
@@ -527,9 +920,7 @@ radix_remove(radix_tree_t *radix, radix_node_t *node)
 	parent = node->parent;
 	child->parent = parent;
 
-	Deref_Prefix(node->prefix);
-	PyMem_Free(node);
-	radix->num_active_node--;
+	radix_free_node(radix, node);
 
 	if (parent == NULL) {
 		radix->head = child;
@@ -541,6 +932,409 @@ radix_remove(radix_tree_t *radix, radix_node_t *node)
 		parent->l = child;
 }
 
+/*
+ * Snapshots. A tree is saved as a preorder list of its nodes, each a
+ * flags byte, the node's bit and, for nodes with a prefix, the bytes of
+ * the address covered by the prefix. Restoring rebuilds the nodes and
+ * links straight from this topology, without searching the tree.
+ */
+#define RADIX_SNAP_PREFIX	0x01
+#define RADIX_SNAP_LEFT		0x02
+#define RADIX_SNAP_RIGHT	0x04
+
+/*
+ * Write the snapshot of a tree to buf, which must be large enough.
+ * Returns the length of the snapshot; if buf is NULL, just the length.
+ */
+size_t
+radix_snapshot(radix_tree_t *radix, u_char *buf)
+{
+	radix_node_t *stack[RADIX_MAXBITS + 1], **sp = stack, *node;
+	size_t len = 0, alen;
+
+	node = radix->head;
+	while (node != NULL) {
+		alen = RADIX_HAS_PREFIX(node) ? (node->bit + 7) / 8 : 0;
+		if (buf != NULL) {
+			buf[len] = (RADIX_HAS_PREFIX(node) ?
+			    RADIX_SNAP_PREFIX : 0) |
+			    (node->l ? RADIX_SNAP_LEFT : 0) |
+			    (node->r ? RADIX_SNAP_RIGHT : 0);
+			buf[len + 1] = node->bit;
+			memcpy(buf + len + 2, node->add, alen);
+		}
+		len += 2 + alen;
+
+		if (node->l) {
+			if (node->r)
+				*sp++ = node->r;
+			node = node->l;
+		} else if (node->r)
+			node = node->r;
+		else if (sp != stack)
+			node = *(--sp);
+		else
+			node = NULL;
+	}
+	return (len);
+}
+
+/*
+ * Rebuild an empty tree from a snapshot of len bytes. The snapshot is
+ * checked as it is read, so that a corrupt one cannot produce a tree
+ * that violates the invariants the other routines rely on: every node's
+ * bit exceeds its parent's, glue nodes have two children, and each
+ * prefix lies on the path that a search for it would take. Returns 0,
+ * or -1 with *errmsg set, in which case the tree is left empty.
+ */
+int
+radix_restore(radix_tree_t *radix, u_char *buf, size_t len,
+    const char **errmsg)
+{
+	struct {
+		radix_node_t *node;
+		u_char *ref;	/* First prefix found below the node */
+	} path[RADIX_MAXBITS + 1];
+	struct {
+		int depth;	/* Of the parent in path[] */
+		int right;
+	} slots[RADIX_MAXBITS + 2], *sp = slots;
+	radix_node_t *node, *parent;
+	u_char *ep = buf + len;
+	u_int flags, bit, alen, pbit;
+	int depth, i;
+
+	*errmsg = "Corrupt snapshot";
+	if (radix->head != NULL) {
+		*errmsg = "Tree is not empty";
+		return (-1);
+	}
+	if (len == 0)
+		return (0);
+
+	sp->depth = -1;
+	sp->right = 0;
+	sp++;
+	while (sp != slots) {
+		sp--;
+		if (ep - buf < 2)
+			goto bad;
+		flags = buf[0];
+		bit = buf[1];
+		buf += 2;
+		if ((flags & ~(RADIX_SNAP_PREFIX | RADIX_SNAP_LEFT |
+		    RADIX_SNAP_RIGHT)) != 0 || bit > radix->maxbits)
+			goto bad;
+		if (!(flags & RADIX_SNAP_PREFIX) &&
+		    (flags & (RADIX_SNAP_LEFT | RADIX_SNAP_RIGHT)) !=
+		    (RADIX_SNAP_LEFT | RADIX_SNAP_RIGHT))
+			goto bad;
+		parent = (sp->depth >= 0) ? path[sp->depth].node : NULL;
+		if (parent != NULL && bit <= parent->bit)
+			goto bad;
+		alen = (flags & RADIX_SNAP_PREFIX) ? (bit + 7) / 8 : 0;
+		if ((size_t)(ep - buf) < alen)
+			goto bad;
+
+		if ((node = radix_new_node(radix, bit, NULL)) == NULL) {
+			*errmsg = "Couldn't allocate node";
+			goto bad;
+		}
+		node->parent = parent;
+		if (parent == NULL)
+			radix->head = node;
+		else if (sp->right)
+			parent->r = node;
+		else
+			parent->l = node;
+		depth = sp->depth + 1;
+		path[depth].node = node;
+		path[depth].ref = NULL;
+
+		if (flags & RADIX_SNAP_PREFIX) {
+			node->family = (radix->maxbits == 32) ?
+			    AF_INET : AF_INET6;
+			radix->num_prefixes++;
+			memcpy(node->add, buf, alen);
+			buf += alen;
+			/*
+			 * Prefixes added in packed form may have host bits
+			 * set; like the old pickle format, drop them.
+			 */
+			if (bit % 8)
+				node->add[alen - 1] &= 0xff << (8 - bit % 8);
+			/*
+			 * Check the branch taken at each ancestor, and that
+			 * the prefix shares an ancestor's leading bits with
+			 * the prefixes already found below it. Those were
+			 * checked against the ancestors above in turn, so
+			 * the walk can stop at the first such ancestor.
+			 */
+			path[depth].ref = node->add;
+			for (i = depth - 1; i >= 0; i--) {
+				pbit = path[i].node->bit;
+				if (!BIT_TEST(node->add[pbit >> 3],
+				    0x80 >> (pbit & 0x07)) !=
+				    (path[i + 1].node != path[i].node->r))
+					goto bad;
+				if (path[i].ref == NULL)
+					path[i].ref = node->add;
+				else {
+					if (!comp_with_mask(path[i].ref,
+					    node->add, pbit))
+						goto bad;
+					break;
+				}
+			}
+		}
+
+		/* The left subtree comes first */
+		if (flags & RADIX_SNAP_RIGHT) {
+			sp->depth = depth;
+			sp->right = 1;
+			sp++;
+		}
+		if (flags & RADIX_SNAP_LEFT) {
+			sp->depth = depth;
+			sp->right = 0;
+			sp++;
+		}
+	}
+	if (buf != ep)
+		goto bad;
+	return (0);
+
+ bad:
+	Clear_Radix(radix, NULL, NULL);
+	return (-1);
+}
+
+/*
+ * Copy a tree into an empty tree of the same family in one preorder
+ * walk, allocating the nodes in order without searching or comparing
+ * any prefixes. The data of each copy is the original's, or if func is
+ * supplied, is set by func(node, copy, cbctx) for each node that has
+ * data. Returns 0, or -1 if memory ran out or func failed, in which case
+ * the copy is left partly built: the caller must destroy it, releasing
+ * the data func has set.
+ */
+int
+radix_clone(radix_tree_t *radix, radix_tree_t *copy, rdx_clone_cb_t func,
+    void *cbctx)
+{
+	struct {
+		radix_node_t *node;
+		radix_node_t *parent;	/* Of the node's copy */
+	} stack[RADIX_MAXBITS + 1], *sp = stack;
+	radix_node_t *node, *new, *parent = NULL;
+
+	node = radix->head;
+	while (node != NULL) {
+		if ((new = slab_alloc(&copy->node_slab)) == NULL)
+			return (-1);
+		memcpy(new, node, RADIX_NODE_SIZE(radix));
+		new->id = 0;
+		new->l = new->r = NULL;
+		new->parent = parent;
+		if (parent == NULL)
+			copy->head = new;
+		else if (node == node->parent->r)
+			parent->r = new;
+		else
+			parent->l = new;
+		copy->num_active_node++;
+		if (RADIX_HAS_PREFIX(node))
+			copy->num_prefixes++;
+		if (func != NULL) {
+			new->data = NULL;
+			if (node->data != NULL && func(node, new, cbctx) == -1)
+				return (-1);
+		}
+
+		if (node->l) {
+			if (node->r) {
+				sp->node = node->r;
+				sp->parent = new;
+				sp++;
+			}
+			node = node->l;
+			parent = new;
+		} else if (node->r) {
+			node = node->r;
+			parent = new;
+		} else if (sp != stack) {
+			sp--;
+			node = sp->node;
+			parent = sp->parent;
+		} else
+			node = NULL;
+	}
+	return (0);
+}
+
+/*
+ * Write a frozen copy of a tree to nodes, which must have room for
+ * radix->num_active_node entries. If func is supplied, the value of each
+ * node with a prefix is set to func(node, cbctx).
+ */
+void
+radix_freeze(radix_tree_t *radix, radix_frozen_node_t *nodes,
+    rdx_value_cb_t func, void *cbctx)
+{
+	struct {
+		radix_node_t *node;
+		u_int32_t *link;	/* Where to store its index */
+	} stack[RADIX_MAXBITS + 1], *sp = stack;
+	radix_frozen_node_t *fn;
+	radix_node_t *node;
+	u_int32_t i, *link = NULL;
+
+	node = radix->head;
+	for (i = 0; node != NULL; i++) {
+		fn = &nodes[i];
+		memset(fn, '\0', sizeof(*fn));
+		fn->bit = node->bit;
+		if (RADIX_HAS_PREFIX(node)) {
+			fn->flags = RADIX_FROZEN_PREFIX;
+			memcpy(fn->add, node->add, radix->maxbits / 8);
+			if (func != NULL)
+				fn->value = func(node, cbctx);
+		}
+		if (link != NULL)
+			*link = i + 1;
+
+		if (node->l) {
+			if (node->r) {
+				sp->node = node->r;
+				sp->link = &fn->r;
+				sp++;
+			}
+			link = &fn->l;
+			node = node->l;
+		} else if (node->r) {
+			link = &fn->r;
+			node = node->r;
+		} else if (sp != stack) {
+			sp--;
+			node = sp->node;
+			link = sp->link;
+		} else
+			node = NULL;
+	}
+}
+
+/*
+ * Set up a frozen tree over num_nodes nodes written by radix_freeze(),
+ * checking that searches of it will stay within the buffer and end.
+ * Returns 0, or -1 if the nodes are corrupt.
+ */
+int
+radix_frozen_init(radix_frozen_t *frozen, int family,
+    radix_frozen_node_t *nodes, u_int32_t num_nodes)
+{
+	radix_frozen_node_t *node;
+	u_int32_t i;
+
+	frozen->nodes = nodes;
+	frozen->num_nodes = num_nodes;
+	frozen->maxbits = (family == AF_INET) ? 32 : 128;
+	frozen->family = family;
+
+	for (i = 0; i < num_nodes; i++) {
+		node = &nodes[i];
+		if (node->bit > frozen->maxbits ||
+		    (node->flags & ~RADIX_FROZEN_PREFIX) != 0)
+			return (-1);
+		/* Children follow their parent and are deeper */
+		if (node->l != 0 && (node->l <= i + 1 || node->l > num_nodes ||
+		    nodes[node->l - 1].bit <= node->bit))
+			return (-1);
+		if (node->r != 0 && (node->r <= i + 1 || node->r > num_nodes ||
+		    nodes[node->r - 1].bit <= node->bit))
+			return (-1);
+	}
+	return (0);
+}
+
+radix_frozen_node_t *
+radix_frozen_search_exact(radix_frozen_t *frozen, prefix_t *prefix)
+{
+	radix_frozen_node_t *node;
+	u_char *addr;
+	u_int bitlen;
+	u_int32_t next;
+
+	if (frozen->num_nodes == 0)
+		return (NULL);
+
+	node = frozen->nodes;
+	addr = prefix_touchar(prefix);
+	bitlen = prefix->bitlen;
+
+	while (node->bit < bitlen) {
+		if (BIT_TEST(addr[node->bit >> 3], 0x80 >> (node->bit & 0x07)))
+			next = node->r;
+		else
+			next = node->l;
+
+		if (next == 0)
+			return (NULL);
+		node = &frozen->nodes[next - 1];
+	}
+
+	if (node->bit > bitlen || !(node->flags & RADIX_FROZEN_PREFIX))
+		return (NULL);
+
+	if (comp_with_mask(node->add, addr, bitlen))
+		return (node);
+
+	return (NULL);
+}
+
+radix_frozen_node_t *
+radix_frozen_search_best(radix_frozen_t *frozen, prefix_t *prefix)
+{
+	radix_frozen_node_t *node, *best = NULL;
+	u_char *addr;
+	u_int bitlen;
+	u_int32_t next;
+
+	if (frozen->num_nodes == 0)
+		return (NULL);
+
+	node = frozen->nodes;
+	addr = prefix_touchar(prefix);
+	bitlen = prefix->bitlen;
+
+	/* Nodes deeper down the path hold longer prefixes */
+	for (;;) {
+		if (node->bit > bitlen)
+			break;
+		if ((node->flags & RADIX_FROZEN_PREFIX) &&
+		    comp_with_mask(node->add, addr, node->bit))
+			best = node;
+		if (node->bit == bitlen)
+			break;
+		if (BIT_TEST(addr[node->bit >> 3], 0x80 >> (node->bit & 0x07)))
+			next = node->r;
+		else
+			next = node->l;
+		if (next == 0)
+			break;
+		node = &frozen->nodes[next - 1];
+	}
+	return (best);
+}
+
+prefix_t *
+radix_frozen_node_prefix(radix_frozen_t *frozen, radix_frozen_node_t *node,
+    prefix_t *prefix)
+{
+	if (!(node->flags & RADIX_FROZEN_PREFIX))
+		return (NULL);
+	return (New_Prefix2(frozen->family, node->add, node->bit, prefix));
+}
+
 /* Local additions */
 static void
 sanitise_mask(u_char *addr, u_int masklen, u_int maskbits)
@@ -556,84 +1350,205 @@ sanitise_mask(u_char *addr, u_int masklen, u_int maskbits)
 		addr[i] = 0;
 }
 
+/*
+ * Fast, non-allocating parsers for the usual textual address forms. They
+ * are deliberately strict: anything they don't accept (leading zeroes,
+ * inet_aton() shorthand, scope identifiers...) is handed to getaddrinfo(),
+ * so the accepted syntax and error messages stay the same.
+ */
+static int
+parse_inet4(const char *cp, const char *ep, u_char *dst)
+{
+	u_int val;
+	int i, digits;
+
+	for (i = 0; i < 4; i++) {
+		if (i > 0 && (cp == ep || *cp++ != '.'))
+			return (0);
+		for (val = 0, digits = 0; cp < ep &&
+		    *cp >= '0' && *cp <= '9'; cp++) {
+			if (digits > 0 && val == 0)
+				return (0);
+			val = val * 10 + (*cp - '0');
+			if (++digits > 3 || val > 255)
+				return (0);
+		}
+		if (digits == 0)
+			return (0);
+		dst[i] = val;
+	}
+	return (cp == ep);
+}
+
+/* After inet_pton6() from BIND */
+static int
+parse_inet6(const char *cp, const char *ep, u_char *dst)
+{
+	u_char *tp, *endp, *colonp;
+	const char *curtok;
+	u_int val;
+	int ch, digits, xval, n, i;
+
+	memset(dst, '\0', 16);
+	tp = dst;
+	endp = dst + 16;
+	colonp = NULL;
+
+	/* Leading :: requires some special handling */
+	if (cp < ep && *cp == ':' && (++cp == ep || *cp != ':'))
+		return (0);
+	curtok = cp;
+	digits = 0;
+	val = 0;
+	while (cp < ep) {
+		ch = *cp++;
+		if (ch >= '0' && ch <= '9')
+			xval = ch - '0';
+		else if (ch >= 'a' && ch <= 'f')
+			xval = ch - 'a' + 10;
+		else if (ch >= 'A' && ch <= 'F')
+			xval = ch - 'A' + 10;
+		else
+			xval = -1;
+		if (xval != -1) {
+			val = (val << 4) | xval;
+			if (++digits > 4)
+				return (0);
+			continue;
+		}
+		if (ch == ':') {
+			curtok = cp;
+			if (digits == 0) {
+				if (colonp != NULL)
+					return (0);
+				colonp = tp;
+				continue;
+			} else if (cp == ep)
+				return (0);
+			if (tp + 2 > endp)
+				return (0);
+			*tp++ = (val >> 8) & 0xff;
+			*tp++ = val & 0xff;
+			digits = 0;
+			val = 0;
+			continue;
+		}
+		if (ch == '.' && tp + 4 <= endp &&
+		    parse_inet4(curtok, ep, tp)) {
+			tp += 4;
+			digits = 0;
+			break;
+		}
+		return (0);
+	}
+	if (digits != 0) {
+		if (tp + 2 > endp)
+			return (0);
+		*tp++ = (val >> 8) & 0xff;
+		*tp++ = val & 0xff;
+	}
+	if (colonp != NULL) {
+		/* Shift the groups after the :: to the end of the address */
+		if (tp == endp)
+			return (0);
+		n = tp - colonp;
+		for (i = 1; i <= n; i++) {
+			endp[-i] = colonp[n - i];
+			colonp[n - i] = 0;
+		}
+		tp = endp;
+	}
+	return (tp == endp);
+}
+
 prefix_t
-*prefix_pton(const char *string, long len, const char **errmsg)
+*prefix_pton(const char *string, long len, prefix_t *prefix,
+    const char **errmsg)
 {
-	char save[256], *cp, *ep;
+	char save[256], *mp;
+	const char *cp, *ep;
 	struct addrinfo hints, *ai;
-	void *addr;
+	u_char addr[16];
 	prefix_t *ret;
 	size_t slen;
-	int r;
-
-	ret = NULL;
+	int r, family, maxbits;
 
-	/* Copy the string to parse, because we modify it */
 	if ((slen = strlen(string) + 1) > sizeof(save)) {
 		*errmsg = "string too long";
 		return (NULL);
 	}
-	memcpy(save, string, slen);
+	ep = string + slen - 1;
 
-	if ((cp = strchr(save, '/')) != NULL) {
+	if ((cp = strchr(string, '/')) != NULL) {
 		if (len != -1 ) {
 			*errmsg = "masklen specified twice";
 			return (NULL);
 		}
-		*cp++ = '\0';
-		len = strtol(cp, &ep, 10);
-		if (*cp == '\0' || *ep != '\0' || len < 0) {
+		len = strtol(cp + 1, &mp, 10);
+		if (cp[1] == '\0' || *mp != '\0' || len < 0) {
 			*errmsg = "could not parse masklen";
 			return (NULL);
 		}
+		ep = cp;
 		/* More checks below */
 	}
-	memset(&hints, '\0', sizeof(hints));
-	hints.ai_flags = AI_NUMERICHOST;
 
-	if ((r = getaddrinfo(save, NULL, &hints, &ai)) != 0) {
-		*errmsg = gai_strerror(r);
-		return NULL;
-	}
-	if (ai == NULL || ai->ai_addr == NULL) {
-		*errmsg = "getaddrinfo returned no result";
-		goto out;
-	}
-	switch (ai->ai_addr->sa_family) {
-	case AF_INET:
-		if (len == -1)
-			len = 32;
-		else if (len < 0 || len > 32) {
-			*errmsg = "invalid prefix length";
-			goto out;
+	if (parse_inet4(string, ep, addr))
+		family = AF_INET;
+	else if (parse_inet6(string, ep, addr))
+		family = AF_INET6;
+	else {
+		/* Unusual syntax or an error; let getaddrinfo() decide */
+		memcpy(save, string, ep - string);
+		save[ep - string] = '\0';
+		memset(&hints, '\0', sizeof(hints));
+		hints.ai_flags = AI_NUMERICHOST;
+
+		if ((r = getaddrinfo(save, NULL, &hints, &ai)) != 0) {
+			*errmsg = gai_strerror(r);
+			return NULL;
 		}
-		addr = &((struct sockaddr_in *) ai->ai_addr)->sin_addr;
-		sanitise_mask(addr, len, 32);
-		break;
-	case AF_INET6:
-		if (len == -1)
-			len = 128;
-		else if (len < 0 || len > 128) {
-			*errmsg = "invalid prefix length";
-			goto out;
+		if (ai == NULL || ai->ai_addr == NULL) {
+			*errmsg = "getaddrinfo returned no result";
+			if (ai != NULL)
+				freeaddrinfo(ai);
+			return (NULL);
 		}
-		addr = &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
-		sanitise_mask(addr, len, 128);
-		break;
-	default:
-		goto out;
+		family = ai->ai_addr->sa_family;
+		switch (family) {
+		case AF_INET:
+			memcpy(addr, &((struct sockaddr_in *)
+			    ai->ai_addr)->sin_addr, 4);
+			break;
+		case AF_INET6:
+			memcpy(addr, &((struct sockaddr_in6 *)
+			    ai->ai_addr)->sin6_addr, 16);
+			break;
+		default:
+			*errmsg = "unsupported address family";
+			freeaddrinfo(ai);
+			return (NULL);
+		}
+		freeaddrinfo(ai);
+	}
+
+	maxbits = (family == AF_INET) ? 32 : 128;
+	if (len == -1)
+		len = maxbits;
+	else if (len < 0 || len > maxbits) {
+		*errmsg = "invalid prefix length";
+		return (NULL);
 	}
+	sanitise_mask(addr, len, maxbits);
 
-	ret = New_Prefix2(ai->ai_addr->sa_family, addr, len, NULL);
+	ret = New_Prefix2(family, addr, len, prefix);
 	if (ret == NULL)
 		*errmsg = "New_Prefix2 failed";
-out:
-	freeaddrinfo(ai);
 	return (ret);
 }
 
 prefix_t
-*prefix_from_blob(u_char *blob, int len, int prefixlen)
+*prefix_from_blob(u_char *blob, int len, int prefixlen, prefix_t *prefix)
 {
 	int family, maxprefix;
 
@@ -656,7 +1571,7 @@ prefix_t
 		prefixlen = maxprefix;
 	if (prefixlen < 0 || prefixlen > maxprefix)
 		return NULL;
-	return (New_Prefix2(family, blob, prefixlen, NULL));
+	return (New_Prefix2(family, blob, prefixlen, prefix));
 }
 
 const char *
@@ -65,6 +65,7 @@
 #include <ws2tcpip.h>
 #else
 # include <sys/types.h>
+# include <stdint.h>
 # include <sys/socket.h>
 # include <netinet/in.h>
 # include <arpa/inet.h>
@@ -76,6 +77,8 @@
 typedef unsigned __int8		u_int8_t;
 typedef unsigned __int16	u_int16_t;
 typedef unsigned __int32	u_int32_t;
+typedef unsigned __int64	u_int64_t;
+typedef __int64			int64_t;
 const char *inet_ntop(int af, const void *src, char *dst, size_t size);
 size_t strlcpy(char *dst, const char *src, size_t size);
 #endif
@@ -87,43 +90,105 @@ size_t strlcpy(char *dst, const char *src, size_t size);
 typedef struct _prefix_t {
 	u_int family;			/* AF_INET | AF_INET6 */
 	u_int bitlen;			/* same as mask? */
-	int ref_count;			/* reference count */
 	union {
 		struct in_addr sin;
 		struct in6_addr sin6;
 	} add;
 } prefix_t;
 
-void Deref_Prefix(prefix_t *prefix);
-
 /*
  * Originally from MRT include/radix.h
  * $MRTId: radix.h,v 1.1.1.1 2000/08/14 18:46:10 labovit Exp $
  */
+/*
+ * The node's prefix is stored inline: its length is the node's bit and
+ * its address occupies the tail of the node, sized for the tree's family.
+ * Glue nodes have no prefix and a family of zero.
+ */
 typedef struct _radix_node_t {
-	u_int bit;			/* flag if this node used */
-	prefix_t *prefix;		/* who we are in radix tree */
+	u_short bit;			/* prefix length, or glue's branch bit */
+	u_short family;			/* AF_INET | AF_INET6, 0 if glue */
+	u_int32_t id;			/* slot in a compiled table, if any */
 	struct _radix_node_t *l, *r;	/* left and right children */
 	struct _radix_node_t *parent;	/* may be used */
 	void *data;			/* pointer to data */
+	u_char add[];			/* who we are in radix tree */
 } radix_node_t;
 
+#define RADIX_HAS_PREFIX(node)	((node)->family != 0)
+
+/*
+ * Per-tree slab allocator: objects are carved out of chunks owned by the
+ * tree and recycled through a free list.
+ */
+typedef struct _radix_slab_t {
+	void *chunks;			/* chunks owned by this slab */
+	void *freelist;			/* released objects, for reuse */
+	u_char *avail;			/* unused space in the newest chunk */
+	u_int navail;			/* objects left at avail */
+	u_int nextsize;			/* objects in the next chunk */
+	size_t objsize;			/* size of one object */
+	size_t allocated;		/* bytes in chunks */
+} radix_slab_t;
+
+#ifdef RADIX_STATS
+/*
+ * Operation counters, kept only if built with -DRADIX_STATS. Searches
+ * made without the GIL may run at once, so their counts are approximate.
+ */
+typedef struct _radix_stats_t {
+	u_int64_t lookups;		/* radix_lookup calls */
+	u_int64_t removes;		/* radix_remove calls */
+	u_int64_t exact_searches;	/* radix_search_exact calls */
+	u_int64_t best_searches;	/* radix_search_best calls */
+	u_int64_t walks;		/* best searches walking the tree */
+	u_int64_t walk_steps;		/* nodes visited by those walks */
+	u_int max_walk_steps;
+} radix_stats_t;
+#endif
+
+struct _radix_dir24_t;
+struct _radix_poptrie_t;
+
 typedef struct _radix_tree_t {
 	radix_node_t *head;
 	u_int maxbits;			/* for IP, 32 bit addresses */
 	int num_active_node;		/* for debug purpose */
+	int num_prefixes;		/* nodes holding a prefix */
+	radix_slab_t node_slab;		/* storage for radix_node_t */
+	struct _radix_dir24_t *dir24;	/* compiled IPv4 table, or NULL */
+	struct _radix_poptrie_t *poptrie; /* compiled IPv6 table, or NULL */
+	u_int shares;			/* holders beyond the first, which
+					 * may not change the tree */
+#ifdef RADIX_STATS
+	radix_stats_t stats;
+#endif
 } radix_tree_t;
 
 /* Type of callback function */
 typedef void (*rdx_cb_t)(radix_node_t *, void *);
+/* Sets the data of a copy of a node, see radix_clone() */
+typedef int (*rdx_clone_cb_t)(radix_node_t *, radix_node_t *, void *);
 
-radix_tree_t *New_Radix(void);
+radix_tree_t *New_Radix(int family);
 void Destroy_Radix(radix_tree_t *radix, rdx_cb_t func, void *cbctx);
 radix_node_t *radix_lookup(radix_tree_t *radix, prefix_t *prefix);
+radix_node_t *radix_lookup_hint(radix_tree_t *radix, prefix_t *prefix,
+    radix_node_t *hint);
 void radix_remove(radix_tree_t *radix, radix_node_t *node);
 radix_node_t *radix_search_exact(radix_tree_t *radix, prefix_t *prefix);
 radix_node_t *radix_search_best(radix_tree_t *radix, prefix_t *prefix);
+radix_node_t *radix_search_subtree(radix_tree_t *radix, prefix_t *prefix);
+size_t radix_memory(radix_tree_t *radix);
+void radix_depths(radix_tree_t *radix, u_int *depths);
+int radix_search_covering(radix_tree_t *radix, prefix_t *prefix, int inclusive,
+    radix_node_t **nodes);
 void radix_process(radix_tree_t *radix, rdx_cb_t func, void *cbctx);
+size_t radix_snapshot(radix_tree_t *radix, u_char *buf);
+int radix_restore(radix_tree_t *radix, u_char *buf, size_t len,
+    const char **errmsg);
+int radix_clone(radix_tree_t *radix, radix_tree_t *copy, rdx_clone_cb_t func,
+    void *cbctx);
 
 #define RADIX_MAXBITS 128
 
@@ -133,7 +198,7 @@ void radix_process(radix_tree_t *radix, rdx_cb_t func, void *cbctx);
 		radix_node_t **Xsp = Xstack; \
 		radix_node_t *Xrn = (Xhead); \
 		while ((Xnode = Xrn)) { \
-			if (Xnode->prefix)
+			if (RADIX_HAS_PREFIX(Xnode))
 
 #define RADIX_WALK_END \
 			if (Xrn->l) { \
@@ -151,10 +216,67 @@ void radix_process(radix_tree_t *radix, rdx_cb_t func, void *cbctx);
 		} \
 	} while (0)
 
+/*
+ * Frozen trees: a read-only copy of a tree in a flat, pointer-free
+ * buffer, which may be a file mapped by several processes. Nodes are
+ * stored in preorder, so the root is the first one and every node
+ * comes before its children, which are referred to by index. The
+ * buffer is in native byte order.
+ */
+typedef struct _radix_frozen_node_t {
+	u_int32_t l, r;			/* child's index + 1, 0 if none */
+	u_int32_t bit;
+	u_int32_t flags;		/* RADIX_FROZEN_PREFIX if not glue */
+	int64_t value;			/* see radix_freeze() */
+	u_char add[16];
+} radix_frozen_node_t;
+
+#define RADIX_FROZEN_PREFIX	0x01
+
+typedef struct _radix_frozen_t {
+	radix_frozen_node_t *nodes;
+	u_int32_t num_nodes;
+	u_int maxbits;
+	u_int family;
+} radix_frozen_t;
+
+typedef int64_t (*rdx_value_cb_t)(radix_node_t *, void *);
+
+void radix_freeze(radix_tree_t *radix, radix_frozen_node_t *nodes,
+    rdx_value_cb_t func, void *cbctx);
+int radix_frozen_init(radix_frozen_t *frozen, int family,
+    radix_frozen_node_t *nodes, u_int32_t num_nodes);
+radix_frozen_node_t *radix_frozen_search_exact(radix_frozen_t *frozen,
+    prefix_t *prefix);
+radix_frozen_node_t *radix_frozen_search_best(radix_frozen_t *frozen,
+    prefix_t *prefix);
+prefix_t *radix_frozen_node_prefix(radix_frozen_t *frozen,
+    radix_frozen_node_t *node, prefix_t *prefix);
+
+/* Compiled IPv4 lookup tables, in radix_dir24.c */
+int radix_dir24_compile(radix_tree_t *radix);
+void radix_dir24_free(radix_tree_t *radix);
+void radix_dir24_add(radix_tree_t *radix, radix_node_t *node);
+void radix_dir24_remove(radix_tree_t *radix, radix_node_t *node);
+radix_node_t *radix_dir24_lookup(struct _radix_dir24_t *dir24, u_char *addr);
+size_t radix_dir24_memory(struct _radix_dir24_t *dir24);
+
+/* Compiled IPv6 lookup tables, in radix_poptrie.c */
+int radix_poptrie_compile(radix_tree_t *radix);
+void radix_poptrie_free(radix_tree_t *radix);
+void radix_poptrie_invalidate(radix_tree_t *radix);
+int radix_poptrie_stale(radix_tree_t *radix);
+int radix_poptrie_lookup(struct _radix_poptrie_t *poptrie, u_char *addr,
+    radix_node_t **node);
+size_t radix_poptrie_memory(struct _radix_poptrie_t *poptrie);
+
 /* Local additions */
 
-prefix_t *prefix_pton(const char *string, long len, const char **errmsg);
-prefix_t *prefix_from_blob(u_char *blob, int len, int prefixlen);
+prefix_t *prefix_pton(const char *string, long len, prefix_t *prefix,
+    const char **errmsg);
+prefix_t *prefix_from_blob(u_char *blob, int len, int prefixlen,
+    prefix_t *prefix);
+prefix_t *radix_node_prefix(radix_node_t *node, prefix_t *prefix);
 const char *prefix_addr_ntop(prefix_t *prefix, char *buf, size_t len);
 const char *prefix_ntop(prefix_t *prefix, char *buf, size_t len);
 
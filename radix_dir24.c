@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2026 The py-radix contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "Python.h"
+
+#include <sys/types.h>
+#include <string.h>
+
+#include "radix.h"
+
+/*
+ * Compiled IPv4 lookup table, after the DIR-24-8 scheme of Gupta, Lin
+ * and McKeown. The first-level table has an entry for each /24. The
+ * entry names the longest prefix covering the whole /24. For a /24 that
+ * holds longer prefixes, it instead refers to a group of 256
+ * second-level entries, one per address. A host lookup therefore reads
+ * one or two entries. Entries name prefixes by their node's id, a slot
+ * in the node table.
+ *
+ * radix_lookup and radix_remove patch the table as the tree changes. If
+ * memory runs out while patching, the table is dropped and searches use
+ * the tree again.
+ */
+
+#define DIR24_GROUP	0x80000000U	/* entry refers to a tbl8 group */
+#define DIR24_TBL24	(1 << 24)
+#define DIR24_GROUPSZ	256
+
+struct _radix_dir24_t {
+	u_int32_t *tbl24;		/* by the first 24 address bits */
+	u_int32_t *tbl8;		/* groups, by the last 8 bits */
+	u_int32_t ngroups;		/* groups allocated in tbl8 */
+	u_int32_t used_groups;		/* groups ever handed out */
+	u_int32_t free_group;		/* free group list, + 1 */
+	radix_node_t **nodes;		/* prefix nodes, by id - 1 */
+	u_int32_t *free_ids;		/* stack of released ids */
+	u_int32_t nnodes;		/* size of nodes and free_ids */
+	u_int32_t used_ids;		/* ids ever handed out */
+	u_int32_t nfree_ids;
+};
+
+typedef struct _radix_dir24_t radix_dir24_t;
+
+static int
+dir24_grow(void **p, u_int32_t *n, u_int32_t min, size_t size)
+{
+	u_int32_t newn = (*n == 0) ? min : *n * 2;
+	void *np;
+
+	if (newn >= DIR24_GROUP || (np = PyMem_Realloc(*p,
+	    (size_t)newn * size)) == NULL)
+		return (-1);
+	*p = np;
+	*n = newn;
+	return (0);
+}
+
+static u_int32_t
+dir24_new_id(radix_dir24_t *d, radix_node_t *node)
+{
+	u_int32_t id, n;
+
+	if (d->nfree_ids > 0)
+		id = d->free_ids[--d->nfree_ids];
+	else {
+		if (d->used_ids == d->nnodes) {
+			n = d->nnodes;
+			if (dir24_grow((void **)&d->nodes, &n, 1024,
+			    sizeof(*d->nodes)) == -1 ||
+			    dir24_grow((void **)&d->free_ids, &d->nnodes, 1024,
+			    sizeof(*d->free_ids)) == -1)
+				return (0);
+		}
+		id = ++d->used_ids;
+	}
+	d->nodes[id - 1] = node;
+	node->id = id;
+	return (id);
+}
+
+static u_int32_t
+dir24_new_group(radix_dir24_t *d, u_int32_t fill)
+{
+	u_int32_t g, *group;
+	int i;
+
+	if ((g = d->free_group) != 0) {
+		g--;
+		d->free_group = d->tbl8[g * DIR24_GROUPSZ];
+	} else {
+		if (d->used_groups == d->ngroups &&
+		    dir24_grow((void **)&d->tbl8, &d->ngroups, 64,
+		    DIR24_GROUPSZ * sizeof(*d->tbl8)) == -1)
+			return (0);
+		g = d->used_groups++;
+	}
+	group = &d->tbl8[g * DIR24_GROUPSZ];
+	for (i = 0; i < DIR24_GROUPSZ; i++)
+		group[i] = fill;
+	return (g | DIR24_GROUP);
+}
+
+static void
+dir24_free_group(radix_dir24_t *d, u_int32_t entry)
+{
+	u_int32_t g = entry & ~DIR24_GROUP;
+
+	d->tbl8[g * DIR24_GROUPSZ] = d->free_group;
+	d->free_group = g + 1;
+}
+
+/*
+ * Point entries at "to". When a prefix is added (to is its own id), it
+ * takes the entries naming shorter prefixes; when it is removed, its
+ * own entries pass to the next longest prefix.
+ */
+#define DIR24_TAKES(d, e, node, to) \
+	((to) == (node)->id ? \
+	    ((e) == 0 || (d)->nodes[(e) - 1]->bit <= (node)->bit) : \
+	    (e) == (node)->id)
+
+static void
+dir24_fill(radix_dir24_t *d, u_int32_t *tbl, u_int32_t first, u_int32_t n,
+    radix_node_t *node, u_int32_t to)
+{
+	u_int32_t i, j, e, *group;
+
+	for (i = first; i < first + n; i++) {
+		e = tbl[i];
+		if (e & DIR24_GROUP) {
+			group = &d->tbl8[(e & ~DIR24_GROUP) * DIR24_GROUPSZ];
+			for (j = 0; j < DIR24_GROUPSZ; j++) {
+				if (DIR24_TAKES(d, group[j], node, to))
+					group[j] = to;
+			}
+		} else if (DIR24_TAKES(d, e, node, to))
+			tbl[i] = to;
+	}
+}
+
+/*
+ * Patch the entries covered by a node's prefix, which is being added if
+ * "to" is its id or else removed in favour of "to".
+ */
+static int
+dir24_patch(radix_dir24_t *d, radix_node_t *node, u_int32_t to)
+{
+	u_char *a = node->add;
+	u_int32_t i, e, n, *group;
+	int j;
+
+	/* Packed prefixes may carry host bits */
+	i = (a[0] << 16) | (a[1] << 8) | a[2];
+	if (node->bit <= 24) {
+		n = 1 << (24 - node->bit);
+		dir24_fill(d, d->tbl24, i & ~(n - 1), n, node, to);
+		return (0);
+	}
+
+	if (!((e = d->tbl24[i]) & DIR24_GROUP)) {
+		if (to != node->id)
+			return (0);
+		if ((e = dir24_new_group(d, e)) == 0)
+			return (-1);
+		d->tbl24[i] = e;
+	}
+	group = &d->tbl8[(e & ~DIR24_GROUP) * DIR24_GROUPSZ];
+	n = 1 << (32 - node->bit);
+	dir24_fill(d, group, a[3] & ~(n - 1), n, node, to);
+
+	/* Fold the group back into tbl24 once its entries agree */
+	for (j = 1; j < DIR24_GROUPSZ; j++) {
+		if (group[j] != group[0])
+			return (0);
+	}
+	d->tbl24[i] = group[0];
+	dir24_free_group(d, e);
+	return (0);
+}
+
+void
+radix_dir24_add(radix_tree_t *radix, radix_node_t *node)
+{
+	radix_dir24_t *d = radix->dir24;
+
+	if (dir24_new_id(d, node) == 0 ||
+	    dir24_patch(d, node, node->id) == -1)
+		radix_dir24_free(radix);
+}
+
+void
+radix_dir24_remove(radix_tree_t *radix, radix_node_t *node)
+{
+	radix_dir24_t *d = radix->dir24;
+	radix_node_t *parent;
+
+	/* The longest prefix covering this one is its nearest ancestor */
+	for (parent = node->parent; parent != NULL &&
+	    !RADIX_HAS_PREFIX(parent); parent = parent->parent)
+		;
+	dir24_patch(d, node, parent != NULL ? parent->id : 0);
+	d->free_ids[d->nfree_ids++] = node->id;
+	d->nodes[node->id - 1] = NULL;
+	node->id = 0;
+}
+
+radix_node_t *
+radix_dir24_lookup(radix_dir24_t *d, u_char *addr)
+{
+	u_int32_t e;
+
+	e = d->tbl24[(addr[0] << 16) | (addr[1] << 8) | addr[2]];
+	if (e & DIR24_GROUP)
+		e = d->tbl8[(e & ~DIR24_GROUP) * DIR24_GROUPSZ + addr[3]];
+	return (e != 0 ? d->nodes[e - 1] : NULL);
+}
+
+size_t
+radix_dir24_memory(radix_dir24_t *d)
+{
+	return (sizeof(*d) + DIR24_TBL24 * sizeof(*d->tbl24) +
+	    (size_t)d->ngroups * DIR24_GROUPSZ * sizeof(*d->tbl8) +
+	    (size_t)d->nnodes * (sizeof(*d->nodes) + sizeof(*d->free_ids)));
+}
+
+/*
+ * Build the table for an IPv4 tree. Returns 0, or -1 if memory ran out.
+ * The first-level table alone takes 64MB.
+ */
+int
+radix_dir24_compile(radix_tree_t *radix)
+{
+	radix_dir24_t *d;
+	radix_node_t *node;
+
+	if (radix->maxbits != 32)
+		return (-1);
+	if (radix->dir24 != NULL)
+		return (0);
+	if ((d = PyMem_Malloc(sizeof(*d))) == NULL)
+		return (-1);
+	memset(d, '\0', sizeof(*d));
+	if ((d->tbl24 = PyMem_Malloc(DIR24_TBL24 * sizeof(*d->tbl24))) == NULL) {
+		PyMem_Free(d);
+		return (-1);
+	}
+	memset(d->tbl24, '\0', DIR24_TBL24 * sizeof(*d->tbl24));
+	radix->dir24 = d;
+
+	RADIX_WALK(radix->head, node) {
+		radix_dir24_add(radix, node);
+		if (radix->dir24 == NULL)
+			return (-1);
+	} RADIX_WALK_END;
+	return (0);
+}
+
+void
+radix_dir24_free(radix_tree_t *radix)
+{
+	radix_dir24_t *d = radix->dir24;
+	radix_node_t *node;
+
+	RADIX_WALK(radix->head, node) {
+		node->id = 0;
+	} RADIX_WALK_END;
+	PyMem_Free(d->tbl24);
+	PyMem_Free(d->tbl8);
+	PyMem_Free(d->nodes);
+	PyMem_Free(d->free_ids);
+	PyMem_Free(d);
+	radix->dir24 = NULL;
+}
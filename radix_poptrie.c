@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2026 The py-radix contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "Python.h"
+
+#include <sys/types.h>
+#include <string.h>
+
+#include "radix.h"
+
+/*
+ * Compiled IPv6 lookup table: a poptrie (Asai and Ohara, SIGCOMM 2015).
+ * Each trie node consumes a 6-bit chunk of the address and has 64 slots.
+ * A slot holds either a child node or a leaf, the longest prefix
+ * covering that slot. "vector" marks the slots that hold children. The
+ * children of a node are stored contiguously from "base1", so the child
+ * for a slot is found by counting the bits of vector below it. Runs of
+ * equal leaves are stored once from "base0", with "leafvec" marking where
+ * each run starts. A lookup therefore reads one node per 6 address bits
+ * in use, then one leaf.
+ *
+ * The trie is built from a walk of the tree and is not patched. Any
+ * change to the tree marks it stale until radix_poptrie_compile() is
+ * called again, and searches walk the tree meanwhile.
+ */
+
+#define POPTRIE_STRIDE	6
+#define POPTRIE_SLOTS	(1 << POPTRIE_STRIDE)
+#define POPTRIE_BIT(s)	((u_int64_t)1 << (s))
+/* Slots up to and including s */
+#define POPTRIE_UPTO(s)	(((u_int64_t)2 << (s)) - 1)
+
+typedef struct _poptrie_node_t {
+	u_int64_t vector;		/* slots holding child nodes */
+	u_int64_t leafvec;		/* slots starting a run of leaves */
+	u_int32_t base0;		/* first leaf */
+	u_int32_t base1;		/* first child */
+} poptrie_node_t;
+
+struct _radix_poptrie_t {
+	poptrie_node_t *nodes;
+	u_int32_t nnodes, nodes_size;
+	u_int32_t *leaves;		/* prefix node ids, 0 if none */
+	u_int32_t nleaves, leaves_size;
+	radix_node_t **prefixes;	/* prefix nodes, by id - 1 */
+	u_int32_t nprefixes;
+	int stale;
+};
+
+typedef struct _radix_poptrie_t radix_poptrie_t;
+
+#if defined(__GNUC__)
+# define poptrie_popcount(x)	__builtin_popcountll(x)
+#else
+static u_int
+poptrie_popcount(u_int64_t x)
+{
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return ((x * 0x0101010101010101ULL) >> 56);
+}
+#endif
+
+/* The 6 bits of an address from bit "off"; bits past the end are 0 */
+static u_int
+poptrie_chunk(u_char *addr, u_int off)
+{
+	u_int i = off >> 3, w;
+
+	w = addr[i] << 8;
+	if (i < 15)
+		w |= addr[i + 1];
+	return ((w >> (16 - POPTRIE_STRIDE - (off & 7))) &
+	    (POPTRIE_SLOTS - 1));
+}
+
+static int
+poptrie_grow(void **p, u_int32_t *size, u_int32_t need, size_t objsize)
+{
+	u_int32_t n = (*size == 0) ? 256 : *size;
+	void *np;
+
+	while (n < need) {
+		if (n >= 0x40000000)
+			return (-1);
+		n *= 2;
+	}
+	if (n == *size)
+		return (0);
+	if ((np = PyMem_Realloc(*p, (size_t)n * objsize)) == NULL)
+		return (-1);
+	*p = np;
+	*size = n;
+	return (0);
+}
+
+/*
+ * Fill in trie node "ni" for the address space under the first "off" bits
+ * of the prefixes prefixes[lo..hi), which are all longer than "off" (but
+ * for ::/0 at the root) and sorted as a walk of the tree visits them.
+ * "def" is the longest prefix covering the whole space.
+ */
+static int
+poptrie_build(radix_poptrie_t *pt, u_int32_t ni, size_t lo, size_t hi,
+    u_int off, u_int32_t def)
+{
+	u_int32_t val[POPTRIE_SLOTS], child, prev = 0;
+	size_t clo[POPTRIE_SLOTS], chi[POPTRIE_SLOTS], i;
+	u_int64_t vector = 0, leafvec = 0;
+	u_int s, j, span, nchild;
+	radix_node_t *node;
+
+	for (s = 0; s < POPTRIE_SLOTS; s++) {
+		val[s] = def;
+		clo[s] = chi[s] = 0;
+	}
+	for (i = lo; i < hi; i++) {
+		node = pt->prefixes[i];
+		s = poptrie_chunk(node->add, off);
+		if (node->bit <= off + POPTRIE_STRIDE) {
+			/*
+			 * Ends within this chunk. A prefix always comes
+			 * before the longer ones it covers.
+			 */
+			span = 1 << (off + POPTRIE_STRIDE - node->bit);
+			s &= ~(span - 1);
+			for (j = s; j < s + span; j++)
+				val[j] = node->id;
+		} else {
+			/* Belongs below slot s; these are contiguous */
+			if (chi[s] == 0)
+				clo[s] = i;
+			chi[s] = i + 1;
+			vector |= POPTRIE_BIT(s);
+		}
+	}
+
+	nchild = poptrie_popcount(vector);
+	if (poptrie_grow((void **)&pt->nodes, &pt->nodes_size,
+	    pt->nnodes + nchild, sizeof(*pt->nodes)) == -1 ||
+	    poptrie_grow((void **)&pt->leaves, &pt->leaves_size,
+	    pt->nleaves + POPTRIE_SLOTS, sizeof(*pt->leaves)) == -1)
+		return (-1);
+	pt->nodes[ni].base1 = child = pt->nnodes;
+	pt->nnodes += nchild;
+	pt->nodes[ni].base0 = pt->nleaves;
+	for (s = 0; s < POPTRIE_SLOTS; s++) {
+		if (vector & POPTRIE_BIT(s))
+			continue;
+		if (leafvec == 0 || val[s] != prev) {
+			leafvec |= POPTRIE_BIT(s);
+			pt->leaves[pt->nleaves++] = val[s];
+			prev = val[s];
+		}
+	}
+	pt->nodes[ni].vector = vector;
+	pt->nodes[ni].leafvec = leafvec;
+
+	for (s = 0; s < POPTRIE_SLOTS; s++) {
+		if (!(vector & POPTRIE_BIT(s)))
+			continue;
+		if (poptrie_build(pt, child++, clo[s], chi[s],
+		    off + POPTRIE_STRIDE, val[s]) == -1)
+			return (-1);
+	}
+	return (0);
+}
+
+static void
+poptrie_clear(radix_poptrie_t *pt)
+{
+	PyMem_Free(pt->nodes);
+	PyMem_Free(pt->leaves);
+	PyMem_Free(pt->prefixes);
+	memset(pt, '\0', sizeof(*pt));
+}
+
+/*
+ * Build, or rebuild if it is stale, the trie for an IPv6 tree. Returns 0,
+ * or -1 if memory ran out, in which case the tree has no trie.
+ */
+int
+radix_poptrie_compile(radix_tree_t *radix)
+{
+	radix_poptrie_t *pt = radix->poptrie;
+	radix_node_t *node;
+	u_int32_t n = 0;
+
+	if (radix->maxbits != 128)
+		return (-1);
+	if (pt == NULL) {
+		if ((pt = PyMem_Malloc(sizeof(*pt))) == NULL)
+			return (-1);
+		memset(pt, '\0', sizeof(*pt));
+		radix->poptrie = pt;
+	} else if (!pt->stale)
+		return (0);
+	poptrie_clear(pt);
+
+	if ((pt->prefixes = PyMem_Malloc((radix->num_active_node + 1) *
+	    sizeof(*pt->prefixes))) == NULL)
+		goto fail;
+	RADIX_WALK(radix->head, node) {
+		pt->prefixes[n++] = node;
+		node->id = n;
+	} RADIX_WALK_END;
+	pt->nprefixes = n;
+
+	if (poptrie_grow((void **)&pt->nodes, &pt->nodes_size, 1,
+	    sizeof(*pt->nodes)) == -1)
+		goto fail;
+	pt->nnodes = 1;
+	if (poptrie_build(pt, 0, 0, n, 0, 0) == -1)
+		goto fail;
+	return (0);
+
+ fail:
+	radix_poptrie_free(radix);
+	return (-1);
+}
+
+void
+radix_poptrie_free(radix_tree_t *radix)
+{
+	poptrie_clear(radix->poptrie);
+	PyMem_Free(radix->poptrie);
+	radix->poptrie = NULL;
+}
+
+void
+radix_poptrie_invalidate(radix_tree_t *radix)
+{
+	radix->poptrie->stale = 1;
+}
+
+int
+radix_poptrie_stale(radix_tree_t *radix)
+{
+	return (radix->poptrie->stale);
+}
+
+size_t
+radix_poptrie_memory(radix_poptrie_t *pt)
+{
+	return (sizeof(*pt) + (size_t)pt->nodes_size * sizeof(*pt->nodes) +
+	    (size_t)pt->leaves_size * sizeof(*pt->leaves) +
+	    (size_t)pt->nprefixes * sizeof(*pt->prefixes));
+}
+
+/*
+ * Longest-match lookup of a full-length address. Returns 0 and sets *node,
+ * or -1 if the trie is stale and the tree must be searched instead.
+ */
+int
+radix_poptrie_lookup(radix_poptrie_t *pt, u_char *addr, radix_node_t **node)
+{
+	poptrie_node_t *n;
+	u_int off = 0, s;
+	u_int32_t id;
+
+	if (pt->stale)
+		return (-1);
+	n = pt->nodes;
+	s = poptrie_chunk(addr, 0);
+	while (n->vector & POPTRIE_BIT(s)) {
+		n = &pt->nodes[n->base1 +
+		    poptrie_popcount(n->vector & POPTRIE_UPTO(s)) - 1];
+		off += POPTRIE_STRIDE;
+		s = poptrie_chunk(addr, off);
+	}
+	id = pt->leaves[n->base0 +
+	    poptrie_popcount(n->leafvec & POPTRIE_UPTO(s)) - 1];
+	*node = (id != 0) ? pt->prefixes[id - 1] : NULL;
+	return (0);
+}
@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define PY_SSIZE_T_CLEAN
 #include "Python.h"
 #include "structmember.h"
 #include "radix.h"
@@ -23,11 +24,62 @@
 /* for Py3K */
 #if PY_MAJOR_VERSION >= 3
 # define PyInt_FromLong			PyLong_FromLong
+# define PyInt_FromSize_t		PyLong_FromSize_t
 # define PyString_AsString		PyBytes_AsString
 # define PyString_FromString		PyUnicode_FromString
 # define PyString_FromStringAndSize	PyBytes_FromStringAndSize
 #endif
 
+/*
+ * Reader/writer lock guarding a Radix object's C trees. Batch searches
+ * drop the GIL while they walk the trees and hold the lock for reading;
+ * methods that restructure the trees hold it for writing. Nobody may
+ * block on the lock while holding the GIL.
+ */
+#if defined(_MSC_VER)
+typedef SRWLOCK radix_lock_t;
+# define RADIX_LOCK_INIT(l)	(InitializeSRWLock(l), 0)
+# define RADIX_LOCK_DESTROY(l)	do { } while (0)
+# define RADIX_RDLOCK(l)	AcquireSRWLockShared(l)
+# define RADIX_RDUNLOCK(l)	ReleaseSRWLockShared(l)
+# define RADIX_WRLOCK(l)	AcquireSRWLockExclusive(l)
+# define RADIX_TRYWRLOCK(l)	TryAcquireSRWLockExclusive(l)
+# define RADIX_WRUNLOCK(l)	ReleaseSRWLockExclusive(l)
+#else
+# include <pthread.h>
+typedef pthread_rwlock_t radix_lock_t;
+# define RADIX_LOCK_INIT(l)	radix_lock_init(l)
+# define RADIX_LOCK_DESTROY(l)	pthread_rwlock_destroy(l)
+# define RADIX_RDLOCK(l)	pthread_rwlock_rdlock(l)
+# define RADIX_RDUNLOCK(l)	pthread_rwlock_unlock(l)
+# define RADIX_WRLOCK(l)	pthread_rwlock_wrlock(l)
+# define RADIX_TRYWRLOCK(l)	(pthread_rwlock_trywrlock(l) == 0)
+# define RADIX_WRUNLOCK(l)	pthread_rwlock_unlock(l)
+#endif
+
+#if !defined(_MSC_VER)
+static int
+radix_lock_init(radix_lock_t *lock)
+{
+	pthread_rwlockattr_t attr;
+	int r;
+
+	if ((r = pthread_rwlockattr_init(&attr)) != 0)
+		return (r);
+#if defined(__GLIBC__)
+	/* Don't let a steady stream of batch searches starve writers */
+	pthread_rwlockattr_setkind_np(&attr,
+	    PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	r = pthread_rwlock_init(lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	return (r);
+}
+#endif
+
+/* Batches smaller than this are searched without dropping the GIL */
+#define RADIX_NOGIL_BATCH	64
+
 /* for version before 2.6 */
 #ifndef PyVarObject_HEAD_INIT
 # define PyVarObject_HEAD_INIT(type, size)	PyObject_HEAD_INIT(type) size,
@@ -39,66 +91,77 @@
 /* Prototypes */
 struct _RadixObject;
 struct _RadixIterObject;
-static struct _RadixIterObject *newRadixIterObject(struct _RadixObject *);
-static PyObject *radix_Radix(PyObject *, PyObject *);
+static struct _RadixIterObject *newRadixIterObject(struct _RadixObject *,
+    int, radix_node_t *, int);
+static PyObject *radix_Radix(PyObject *, PyObject *, PyObject *);
 
 /* ------------------------------------------------------------------------ */
 
-PyObject *radix_constructor;
+PyObject *radix_constructor, *intradix_constructor;
 
 /* RadixNode: tree nodes */
 
+/*
+ * The node's prefix is copied into the object, since the radix.c node may
+ * be freed while the object lives on. Its string forms and the user data
+ * dict are only created when they are first asked for.
+ */
 typedef struct {
 	PyObject_HEAD
 	PyObject *user_attr;	/* User-specified attributes */
 	PyObject *network;
 	PyObject *prefix;
-	PyObject *prefixlen;
-	PyObject *family;
 	PyObject *packed;
-	radix_node_t *rn;	/* Actual radix node (pointer to parent) */
+	prefix_t pfx;		/* Copy of the node's prefix */
+	long tag;		/* User-assigned integer, for buffer searches */
 } RadixNodeObject;
 
 static PyTypeObject RadixNode_Type;
 
+/* A RadixNode for a prefix */
 static RadixNodeObject *
-newRadixNodeObject(radix_node_t *rn)
+newRadixNodeObjectPrefix(prefix_t *prefix)
 {
 	RadixNodeObject *self;
-	char network[256], prefix[256];
-
-	/* Sanity check */
-	if (rn == NULL || rn->prefix == NULL || 
-	    (rn->prefix->family != AF_INET && rn->prefix->family != AF_INET6))
-		return NULL;
 
 	self = PyObject_New(RadixNodeObject, &RadixNode_Type);
 	if (self == NULL)
 		return NULL;
 
-	self->rn = rn;
+	self->pfx = *prefix;
+	self->tag = 0;
+	self->user_attr = NULL;
+	self->network = NULL;
+	self->prefix = NULL;
+	self->packed = NULL;
 
-	/* Format addresses for packing into objects */
-	prefix_addr_ntop(rn->prefix, network, sizeof(network));
-	prefix_ntop(rn->prefix, prefix, sizeof(prefix));
+	return self;
+}
+
+static RadixNodeObject *
+newRadixNodeObject(radix_node_t *rn)
+{
+	prefix_t rn_prefix;
 
-	self->user_attr = PyDict_New();
-	self->network = PyString_FromString(network);
-	self->prefix = PyString_FromString(prefix);
-	self->prefixlen = PyInt_FromLong(rn->prefix->bitlen);
-	self->family = PyInt_FromLong(rn->prefix->family);
-	self->packed = PyString_FromStringAndSize((char*)&rn->prefix->add,
-	    rn->prefix->family == AF_INET ? 4 : 16);
+	/* Sanity check */
+	if (rn == NULL || radix_node_prefix(rn, &rn_prefix) == NULL || 
+	    (rn->family != AF_INET && rn->family != AF_INET6))
+		return NULL;
 
-	if (self->user_attr == NULL || self->prefixlen == NULL || 
-	    self->family == NULL || self->network == NULL || 
-	    self->prefix == NULL) {
-		/* RadixNode_dealloc will clean up for us */
-		Py_XDECREF(self);
-		return (NULL);		
-	}
+	return newRadixNodeObjectPrefix(&rn_prefix);
+}
 
-	return self;
+/* Format a prefix as a "network/masklen" string */
+static PyObject *
+prefix_to_string(prefix_t *prefix)
+{
+	char buf[256];
+
+	if (prefix_ntop(prefix, buf, sizeof(buf)) == NULL) {
+		PyErr_SetString(PyExc_ValueError, "Couldn't format prefix");
+		return NULL;
+	}
+	return PyString_FromString(buf);
 }
 
 /* RadixNode methods */
@@ -107,21 +170,86 @@ static void
 RadixNode_dealloc(RadixNodeObject *self)
 {
 	Py_XDECREF(self->user_attr);
-	Py_XDECREF(self->prefixlen);
-	Py_XDECREF(self->family);
 	Py_XDECREF(self->network);
 	Py_XDECREF(self->prefix);
 	Py_XDECREF(self->packed);
 	PyObject_Del(self);
 }
 
+static PyObject *
+RadixNode_get_data(RadixNodeObject *self, void *closure)
+{
+	if (self->user_attr == NULL &&
+	    (self->user_attr = PyDict_New()) == NULL)
+		return NULL;
+	Py_INCREF(self->user_attr);
+	return self->user_attr;
+}
+
+static PyObject *
+RadixNode_get_network(RadixNodeObject *self, void *closure)
+{
+	char buf[256];
+
+	if (self->network == NULL) {
+		if (prefix_addr_ntop(&self->pfx, buf, sizeof(buf)) == NULL) {
+			PyErr_SetString(PyExc_ValueError,
+			    "Couldn't format address");
+			return NULL;
+		}
+		if ((self->network = PyString_FromString(buf)) == NULL)
+			return NULL;
+	}
+	Py_INCREF(self->network);
+	return self->network;
+}
+
+static PyObject *
+RadixNode_get_prefix(RadixNodeObject *self, void *closure)
+{
+	if (self->prefix == NULL &&
+	    (self->prefix = prefix_to_string(&self->pfx)) == NULL)
+		return NULL;
+	Py_INCREF(self->prefix);
+	return self->prefix;
+}
+
+static PyObject *
+RadixNode_get_prefixlen(RadixNodeObject *self, void *closure)
+{
+	return PyInt_FromLong(self->pfx.bitlen);
+}
+
+static PyObject *
+RadixNode_get_family(RadixNodeObject *self, void *closure)
+{
+	return PyInt_FromLong(self->pfx.family);
+}
+
+static PyObject *
+RadixNode_get_packed(RadixNodeObject *self, void *closure)
+{
+	if (self->packed == NULL &&
+	    (self->packed = PyString_FromStringAndSize(
+	    (char *)&self->pfx.add, self->pfx.family == AF_INET ? 4 : 16)) ==
+	    NULL)
+		return NULL;
+	Py_INCREF(self->packed);
+	return self->packed;
+}
+
 static PyMemberDef RadixNode_members[] = {
-	{"data",	T_OBJECT, offsetof(RadixNodeObject, user_attr),	READONLY},
-	{"network",	T_OBJECT, offsetof(RadixNodeObject, network),	READONLY},
-	{"prefix",	T_OBJECT, offsetof(RadixNodeObject, prefix),	READONLY},
-	{"prefixlen",	T_OBJECT, offsetof(RadixNodeObject, prefixlen),	READONLY},
-	{"family",	T_OBJECT, offsetof(RadixNodeObject, family),	READONLY},
-	{"packed",	T_OBJECT, offsetof(RadixNodeObject, packed),	READONLY},
+	{"tag",		T_LONG,   offsetof(RadixNodeObject, tag),	0},
+	{NULL}
+};
+
+static PyGetSetDef RadixNode_getset[] = {
+	{"data",	(getter)RadixNode_get_data,	NULL,	NULL,	NULL},
+	{"network",	(getter)RadixNode_get_network,	NULL,	NULL,	NULL},
+	{"prefix",	(getter)RadixNode_get_prefix,	NULL,	NULL,	NULL},
+	{"prefixlen",	(getter)RadixNode_get_prefixlen, NULL,	NULL,	NULL},
+	{"family",	(getter)RadixNode_get_family,	NULL,	NULL,	NULL},
+	{"packed",	(getter)RadixNode_get_packed,	NULL,	NULL,	NULL},
 	{NULL}
 };
 
@@ -161,7 +289,7 @@ static PyTypeObject RadixNode_Type = {
 	0,			/*tp_iternext*/
 	0,			/*tp_methods*/
 	RadixNode_members,	/*tp_members*/
-	0,			/*tp_getset*/
+	RadixNode_getset,	/*tp_getset*/
 	0,			/*tp_base*/
 	0,			/*tp_dict*/
 	0,			/*tp_descr_get*/
@@ -181,64 +309,143 @@ typedef struct _RadixObject {
 	radix_tree_t *rt4;	/* Radix tree for IPv4 addresses */
 	radix_tree_t *rt6;	/* Radix tree for IPv6 addresses */
 	unsigned int gen_id;	/* Detect modification during iterations */
+	radix_lock_t lock;	/* Held by searches running without the GIL */
+	Py_ssize_t stale_searches; /* IPv6 searches since the table went stale */
+	int mode;		/* RADIX_MODE_*: what the nodes' data holds */
+	int readonly;		/* A snapshot, see Radix.snapshot() */
 } RadixObject;
 
+/*
+ * A tree either hands out a RadixNode for each prefix, or maps each
+ * prefix straight to a value (radix.Radix(mapping=True)), which is kept
+ * as the data of the radix.c node with no RadixNode or dict around it.
+ * An IntRadix maps prefixes to unsigned integers, kept in the data
+ * pointer itself, so that a prefix costs nothing but its radix.c node.
+ */
+#define RADIX_MODE_NODES	0
+#define RADIX_MODE_MAP		1
+#define RADIX_MODE_INT		2
+
+/*
+ * Whether a prefix node of a tree in mode (rno)->mode has been given its
+ * RadixNode or value; an IntRadix value of 0 is a NULL data pointer.
+ */
+#define NODE_IN_USE(rno, node) ((rno)->mode == RADIX_MODE_INT ? \
+	RADIX_HAS_PREFIX(node) : (node)->data != NULL)
+#define NODE_INT(node)		((uintptr_t)(node)->data)
+
 static PyTypeObject Radix_Type;
 #define Radix_CheckExact(op) (Py_TYPE(op) == &Radix_Type)
 
+/* A Radix object for the trees, which stay the caller's on failure */
+static RadixObject *
+newRadixObjectTrees(radix_tree_t *rt4, radix_tree_t *rt6)
+{
+	RadixObject *self;
+
+	if ((self = PyObject_New(RadixObject, &Radix_Type)) == NULL)
+		return (NULL);
+	if (RADIX_LOCK_INIT(&self->lock) != 0) {
+		PyObject_Del(self);
+		PyErr_SetString(PyExc_MemoryError, "Couldn't create lock");
+		return (NULL);
+	}
+	self->rt4 = rt4;
+	self->rt6 = rt6;
+	self->gen_id = 0;
+	self->stale_searches = 0;
+	self->mode = RADIX_MODE_NODES;
+	self->readonly = 0;
+	return (self);
+}
+
 static RadixObject *
 newRadixObject(void)
 {
 	RadixObject *self;
 	radix_tree_t *rt4, *rt6;
 
-	if ((rt4 = New_Radix()) == NULL)
+	if ((rt4 = New_Radix(AF_INET)) == NULL)
 		return (NULL);
-	if ((rt6 = New_Radix()) == NULL) {
-		free(rt4);
+	if ((rt6 = New_Radix(AF_INET6)) == NULL) {
+		Destroy_Radix(rt4, NULL, NULL);
 		return (NULL);
 	}
-	if ((self = PyObject_New(RadixObject, &Radix_Type)) == NULL) {
-		free(rt4);
-		free(rt6);
+	if ((self = newRadixObjectTrees(rt4, rt6)) == NULL) {
+		Destroy_Radix(rt4, NULL, NULL);
+		Destroy_Radix(rt6, NULL, NULL);
 		return (NULL);
 	}
-	self->rt4 = rt4;
-	self->rt6 = rt6;
-	self->gen_id = 0;
 	return (self);
 }
 
 /* Radix methods */
 
+/* Destroy_Radix callback: release the RadixNode or value of a dying node */
 static void
-Radix_dealloc(RadixObject *self)
+release_value(radix_node_t *rn, void *cbctx)
 {
-	radix_node_t *rn;
-	RadixNodeObject *node;
+	Py_DECREF((PyObject *)rn->data);
+}
 
-	RADIX_WALK(self->rt4->head, rn) {
-		if (rn->data != NULL) {
-			node = rn->data;
-			node->rn = NULL;
-			Py_DECREF(node);
-		}
-	} RADIX_WALK_END;
-	RADIX_WALK(self->rt6->head, rn) {
-		if (rn->data != NULL) {
-			node = rn->data;
-			node->rn = NULL;
-			Py_DECREF(node);
-		}
-	} RADIX_WALK_END;
+#define RELEASE_CB(rno) ((rno)->mode == RADIX_MODE_INT ? NULL : release_value)
+
+/* Let go of a tree, destroying it if nobody else holds it */
+static void
+radix_tree_release(radix_tree_t *rt, rdx_cb_t func)
+{
+	if (rt->shares > 0)
+		rt->shares--;
+	else
+		Destroy_Radix(rt, func, NULL);
+}
 
-	Destroy_Radix(self->rt4, NULL, NULL);
-	Destroy_Radix(self->rt6, NULL, NULL);
+static void
+Radix_dealloc(RadixObject *self)
+{
+	radix_tree_release(self->rt4, RELEASE_CB(self));
+	radix_tree_release(self->rt6, RELEASE_CB(self));
+	RADIX_LOCK_DESTROY(&self->lock);
 	PyObject_Del(self);
 }
 
+/* Take the write lock, waiting for readers without holding the GIL */
+static void
+radix_wrlock(RadixObject *self)
+{
+	if (RADIX_TRYWRLOCK(&self->lock))
+		return;
+	Py_BEGIN_ALLOW_THREADS
+	RADIX_WRLOCK(&self->lock);
+	Py_END_ALLOW_THREADS
+}
+
+/*
+ * The compiled IPv6 table is rebuilt rather than patched as the tree
+ * changes. Rebuild it once the searches that had to walk the tree since
+ * it went stale add up to a fair share of the cost of rebuilding.
+ */
+static void
+radix_refresh_compiled(RadixObject *self, Py_ssize_t nsearches)
+{
+	/* Snapshots' readers may be using a shared tree's table */
+	if (self->rt6->poptrie == NULL || !radix_poptrie_stale(self->rt6) ||
+	    self->rt6->shares > 0)
+		return;
+	self->stale_searches += nsearches;
+	if (self->stale_searches < self->rt6->num_active_node / 4)
+		return;
+	radix_wrlock(self);
+	/* Without the memory, the tree still works */
+	if (self->rt6->poptrie != NULL && self->rt6->shares == 0)
+		radix_poptrie_compile(self->rt6);
+	RADIX_WRUNLOCK(&self->lock);
+	self->stale_searches = 0;
+}
+
 static prefix_t
-*args_to_prefix(char *addr, char *packed, int packlen, long prefixlen)
+*args_to_prefix(char *addr, char *packed, Py_ssize_t packlen, long prefixlen,
+    prefix_t *prefix_buf)
 {
 	prefix_t *prefix = NULL;
 	const char *errmsg;
@@ -256,35 +463,143 @@ static prefix_t
 	}
 
 	if (addr != NULL) {		/* Parse a string address */
-		if ((prefix = prefix_pton(addr, prefixlen, &errmsg)) == NULL) {
+		if ((prefix = prefix_pton(addr, prefixlen, prefix_buf,
+		    &errmsg)) == NULL) {
 			PyErr_SetString(PyExc_ValueError, errmsg ? errmsg :
 			    "Invalid address format");
 		}
 	} else if (packed != NULL) {	/* "parse" a packed binary address */
-		if ((prefix = prefix_from_blob((u_char*)packed, packlen, 
-		    prefixlen)) == NULL) {
+		if (packlen > 16 || (prefix = prefix_from_blob((u_char*)packed,
+		    (int)packlen, prefixlen, prefix_buf)) == NULL) {
 			PyErr_SetString(PyExc_ValueError,
 			    "Invalid packed address format");
 		}
 	}
 	if (prefix != NULL &&
-	    prefix->family != AF_INET && prefix->family != AF_INET6) {
-		Deref_Prefix(prefix);
+	    prefix->family != AF_INET && prefix->family != AF_INET6)
 		return (NULL);
-	}
 
 	return prefix;
 }
 
 #define PICKRT(prefix, rno) (prefix->family == AF_INET6 ? rno->rt6 : rno->rt4)
 
-static PyObject *
-create_add_node(RadixObject *self, prefix_t *prefix)
+/* radix_clone callback: the copy of a node holds its RadixNode or value */
+static int
+share_data(radix_node_t *node, radix_node_t *copy, void *cbctx)
+{
+	copy->data = node->data;
+	Py_INCREF((PyObject *)copy->data);
+	return (0);
+}
+
+/*
+ * Copy on write: if other Radix objects share the tree for a family,
+ * switch to a copy of it of our own, leaving them the original. Must be
+ * called with the write lock held, which snapshot() takes to share the
+ * trees, and the tree changed before it is dropped. Returns 0, or -1
+ * with an exception set.
+ */
+static int
+radix_unshare(RadixObject *self, int family)
 {
+	radix_tree_t **rtp, *copy;
+
+	rtp = (family == AF_INET6) ? &self->rt6 : &self->rt4;
+	if ((*rtp)->shares == 0)
+		return (0);
+	if ((copy = New_Radix(family)) == NULL) {
+		PyErr_NoMemory();
+		return (-1);
+	}
+	if (radix_clone(*rtp, copy, self->mode == RADIX_MODE_INT ? NULL :
+	    share_data, NULL) == -1) {
+		Destroy_Radix(copy, RELEASE_CB(self), NULL);
+		PyErr_NoMemory();
+		return (-1);
+	}
+	/* Stay compiled; without the memory, the tree still works */
+	if ((*rtp)->dir24 != NULL)
+		radix_dir24_compile(copy);
+	if ((*rtp)->poptrie != NULL)
+		radix_poptrie_compile(copy);
+	(*rtp)->shares--;
+	*rtp = copy;
+	/* Iterations and add_many hints point into the old tree */
+	self->gen_id++;
+	return (0);
+}
+
+/*
+ * Get ready to change the tree for a family, unless this is a snapshot.
+ * Called with the write lock held, as radix_unshare is.
+ */
+static int
+radix_writable(RadixObject *self, int family)
+{
+	if (self->readonly) {
+		PyErr_SetString(PyExc_TypeError, "Radix snapshot is read-only");
+		return (-1);
+	}
+	return (radix_unshare(self, family));
+}
+
+/*
+ * Share the trees, as a snapshot does, so that they stay as they are
+ * while Python code that may let other threads change them runs.
+ * radix_tree_release() lets go of each.
+ */
+static void
+radix_pin(RadixObject *self, radix_tree_t **rt4, radix_tree_t **rt6)
+{
+	radix_wrlock(self);
+	*rt4 = self->rt4;
+	*rt6 = self->rt6;
+	(*rt4)->shares++;
+	(*rt6)->shares++;
+	RADIX_WRUNLOCK(&self->lock);
+}
+
+/* Methods that deal in RadixNodes, which a mapping hasn't got, start so */
+#define NODES_ONLY(rno, name) do {					\
+	if ((rno)->mode != RADIX_MODE_NODES) {				\
+		PyErr_SetString(PyExc_TypeError,			\
+		    name "() is not supported by a mapping Radix");	\
+		return NULL;						\
+	}								\
+} while (0)
+
+/* Where the previous insertion of a bulk load left off */
+struct add_hint {
 	radix_node_t *node;
+	unsigned int gen_id;	/* Hint is stale once the tree changes */
+};
+
+static PyObject *
+create_add_node(RadixObject *self, prefix_t *prefix, struct add_hint *hint)
+{
+	radix_node_t *node, *start = NULL;
 	RadixNodeObject *node_obj;
 
-	if ((node = radix_lookup(PICKRT(prefix, self), prefix)) == NULL) {
+	radix_wrlock(self);
+	if (radix_writable(self, prefix->family) == -1) {
+		RADIX_WRUNLOCK(&self->lock);
+		return NULL;
+	}
+	if (hint != NULL && hint->node != NULL &&
+	    hint->gen_id == self->gen_id &&
+	    hint->node->family == prefix->family)
+		start = hint->node;
+	node = radix_lookup_hint(PICKRT(prefix, self), prefix, start);
+	if (node != NULL) {
+		self->gen_id++;
+		if (hint != NULL) {
+			hint->node = node;
+			hint->gen_id = self->gen_id;
+		}
+	}
+	RADIX_WRUNLOCK(&self->lock);
+	if (node == NULL) {
 		PyErr_SetString(PyExc_MemoryError, "Couldn't add prefix");
 		return NULL;
 	}
@@ -302,7 +617,6 @@ create_add_node(RadixObject *self, prefix_t *prefix)
 	} else
 		node_obj = node->data;
 
-	self->gen_id++;
 	Py_XINCREF(node_obj);
 	return (PyObject *)node_obj;
 }
@@ -329,26 +643,167 @@ in the RadixNode.data dict.");
 static PyObject *
 Radix_add(RadixObject *self, PyObject *args, PyObject *kw_args)
 {
-	prefix_t *prefix;
+	prefix_t *prefix, prefix_buf;
 	static char *keywords[] = { "network", "masklen", "packed", NULL };
 	PyObject *node_obj;
 
 	char *addr = NULL, *packed = NULL;
 	long prefixlen = -1;
-	int packlen = -1;
+	Py_ssize_t packlen = -1;
 
+	NODES_ONLY(self, "add");
 	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|sls#:add", keywords,
 	    &addr, &prefixlen, &packed, &packlen))
 		return NULL;
-	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen)) == NULL)
+	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen,
+	    &prefix_buf)) == NULL)
 		return NULL;
 
-	node_obj = create_add_node(self, prefix);
-	Deref_Prefix(prefix);
+	node_obj = create_add_node(self, prefix, NULL);
 
 	return node_obj;
 }
 
+/* Remove a prefix and release its RadixNode or value */
+static int
+radix_delete_prefix(RadixObject *self, prefix_t *prefix)
+{
+	radix_node_t *node;
+	PyObject *data;
+
+	/*
+	 * Find the node under the lock: waiting for it lets other threads
+	 * run, and one of them may delete the same prefix meanwhile.
+	 */
+	radix_wrlock(self);
+	if (radix_writable(self, prefix->family) == -1) {
+		RADIX_WRUNLOCK(&self->lock);
+		return (-1);
+	}
+	if ((node = radix_search_exact(PICKRT(prefix, self), prefix)) == NULL) {
+		RADIX_WRUNLOCK(&self->lock);
+		PyErr_SetString(PyExc_KeyError, "no such address");
+		return (-1);
+	}
+	data = node->data;
+	radix_remove(PICKRT(prefix, self), node);
+	self->gen_id++;
+	RADIX_WRUNLOCK(&self->lock);
+
+	if (self->mode != RADIX_MODE_INT)
+		Py_XDECREF(data);
+	return (0);
+}
+
+/*
+ * Store the data for a prefix of a mapping, adding the prefix if need
+ * be: a value, or for an IntRadix an integer cast to a pointer.
+ */
+static int
+mapping_set(RadixObject *self, prefix_t *prefix, void *data,
+    struct add_hint *hint)
+{
+	radix_tree_t *rt;
+	radix_node_t *node, *start = NULL;
+	void *old = NULL;
+	int n;
+
+	radix_wrlock(self);
+	if (radix_writable(self, prefix->family) == -1) {
+		RADIX_WRUNLOCK(&self->lock);
+		return (-1);
+	}
+	rt = PICKRT(prefix, self);
+	if (hint != NULL && hint->node != NULL &&
+	    hint->gen_id == self->gen_id &&
+	    hint->node->family == prefix->family)
+		start = hint->node;
+	n = rt->num_prefixes;
+	if ((node = radix_lookup_hint(rt, prefix, start)) != NULL) {
+		if (self->mode == RADIX_MODE_MAP)
+			Py_INCREF((PyObject *)data);
+		old = node->data;
+		node->data = data;
+		/* Replacing a value doesn't disturb iterations */
+		if (rt->num_prefixes != n)
+			self->gen_id++;
+		if (hint != NULL) {
+			hint->node = node;
+			hint->gen_id = self->gen_id;
+		}
+	}
+	RADIX_WRUNLOCK(&self->lock);
+	if (node == NULL) {
+		PyErr_SetString(PyExc_MemoryError, "Couldn't add prefix");
+		return (-1);
+	}
+	if (self->mode == RADIX_MODE_MAP)
+		Py_XDECREF((PyObject *)old);
+	return (0);
+}
+
+/* Convert an IntRadix value */
+static int
+object_to_int(PyObject *obj, uintptr_t *v)
+{
+	unsigned PY_LONG_LONG ull;
+	PyObject *num;
+
+	if ((num = PyNumber_Index(obj)) == NULL)
+		return (-1);
+#if PY_MAJOR_VERSION < 3
+	if (PyInt_Check(num)) {
+		if (PyInt_AS_LONG(num) < 0) {
+			Py_DECREF(num);
+			PyErr_SetString(PyExc_OverflowError,
+			    "IntRadix values can't be negative");
+			return (-1);
+		}
+		ull = PyInt_AS_LONG(num);
+	} else
+#endif
+	ull = PyLong_AsUnsignedLongLong(num);
+	Py_DECREF(num);
+	if (ull == (unsigned PY_LONG_LONG)-1 && PyErr_Occurred())
+		return (-1);
+	if (ull > (uintptr_t)-1) {
+		PyErr_SetString(PyExc_OverflowError,
+		    "IntRadix value too large");
+		return (-1);
+	}
+	*v = (uintptr_t)ull;
+	return (0);
+}
+
+/* Convert a mapping value to the data kept for it */
+static int
+object_to_data(RadixObject *self, PyObject *obj, void **data)
+{
+	uintptr_t v;
+
+	if (self->mode != RADIX_MODE_INT) {
+		*data = obj;
+		return (0);
+	}
+	if (object_to_int(obj, &v) == -1)
+		return (-1);
+	*data = (void *)v;
+	return (0);
+}
+
+/* What lookups return for a prefix in use: its RadixNode or value */
+static PyObject *
+node_result(RadixObject *self, radix_node_t *node)
+{
+	PyObject *ret;
+
+	if (self->mode == RADIX_MODE_INT)
+		return (PyInt_FromSize_t((size_t)NODE_INT(node)));
+	ret = node->data;
+	Py_INCREF(ret);
+	return (ret);
+}
+
 PyDoc_STRVAR(Radix_delete_doc,
 "Radix.delete(network[, masklen][, packed] -> None\n\
 \n\
@@ -357,35 +812,21 @@ Deletes the specified network from the radix tree.");
 static PyObject *
 Radix_delete(RadixObject *self, PyObject *args, PyObject *kw_args)
 {
-	radix_node_t *node;
-	RadixNodeObject *node_obj;
-	prefix_t *prefix;
+	prefix_t *prefix, prefix_buf;
 	static char *keywords[] = { "network", "masklen", "packed", NULL };
 
 	char *addr = NULL, *packed = NULL;
 	long prefixlen = -1;
-	int packlen = -1;
+	Py_ssize_t packlen = -1;
 
 	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|sls#:delete", keywords,
 	    &addr, &prefixlen, &packed, &packlen))
 		return NULL;
-	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen)) == NULL)
+	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen,
+	    &prefix_buf)) == NULL)
 		return NULL;
-	if ((node = radix_search_exact(PICKRT(prefix, self), prefix)) == NULL) {
-		Deref_Prefix(prefix);
-		PyErr_SetString(PyExc_KeyError, "no such address");
+	if (radix_delete_prefix(self, prefix) == -1)
 		return NULL;
-	}
-	if (node->data != NULL) {
-		node_obj = node->data;
-		node_obj->rn = NULL;
-		Py_XDECREF(node_obj);
-	}
-
-	radix_remove(PICKRT(prefix, self), node);
-	Deref_Prefix(prefix);
-
-	self->gen_id++;
 	Py_INCREF(Py_None);
 	return Py_None;
 }
@@ -404,26 +845,26 @@ Radix_search_exact(RadixObject *self, PyObject *args, PyObject *kw_args)
 {
 	radix_node_t *node;
 	RadixNodeObject *node_obj;
-	prefix_t *prefix;
+	prefix_t *prefix, prefix_buf;
 	static char *keywords[] = { "network", "masklen", "packed", NULL };
 
 	char *addr = NULL, *packed = NULL;
 	long prefixlen = -1;
-	int packlen = -1;
+	Py_ssize_t packlen = -1;
 
+	NODES_ONLY(self, "search_exact");
 	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|sls#:search_exact", keywords,
 	    &addr, &prefixlen, &packed, &packlen))
 		return NULL;
-	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen)) == NULL)
+	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen,
+	    &prefix_buf)) == NULL)
 		return NULL;
 
 	node = radix_search_exact(PICKRT(prefix, self), prefix);
 	if (node == NULL || node->data == NULL) {
-		Deref_Prefix(prefix);
 		Py_INCREF(Py_None);
 		return Py_None;
 	}
-	Deref_Prefix(prefix);
 	node_obj = node->data;
 	Py_XINCREF(node_obj);
 	return (PyObject *)node_obj;
@@ -444,243 +885,2190 @@ Radix_search_best(RadixObject *self, PyObject *args, PyObject *kw_args)
 {
 	radix_node_t *node;
 	RadixNodeObject *node_obj;
-	prefix_t *prefix;
+	prefix_t *prefix, prefix_buf;
 	static char *keywords[] = { "network", "masklen", "packed", NULL };
 
 	char *addr = NULL, *packed = NULL;
 	long prefixlen = -1;
-	int packlen = -1;
+	Py_ssize_t packlen = -1;
 
+	NODES_ONLY(self, "search_best");
 	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|sls#:search_best", keywords,
 	    &addr, &prefixlen, &packed, &packlen))
 		return NULL;
-	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen)) == NULL)
+	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen,
+	    &prefix_buf)) == NULL)
 		return NULL;
+	if (prefix->family == AF_INET6)
+		radix_refresh_compiled(self, 1);
 
 	if ((node = radix_search_best(PICKRT(prefix, self), prefix)) == NULL || 
 	    node->data == NULL) {
-		Deref_Prefix(prefix);
 		Py_INCREF(Py_None);
 		return Py_None;
 	}
-	Deref_Prefix(prefix);
 	node_obj = node->data;
 	Py_XINCREF(node_obj);
 	return (PyObject *)node_obj;
 }
 
-PyDoc_STRVAR(Radix_nodes_doc,
-"Radix.nodes(prefix) -> List of RadixNode\n\
+PyDoc_STRVAR(Radix_search_covered_doc,
+"Radix.search_covered(network[, masklen][, packed] -> List of RadixNode\n\
 \n\
-Returns a list containing all the RadixNode objects that have been\n\
-entered into the tree. This list may be empty if no prefixes have\n\
-been entered.");
+Returns a list of the RadixNodes for every prefix in the tree that is\n\
+covered by the specified network, including the network itself if it is\n\
+in the tree. The list is in the same order as iteration over the tree,\n\
+and is found by walking only the part of the tree under the network.");
 
 static PyObject *
-Radix_nodes(RadixObject *self, PyObject *args)
+Radix_search_covered(RadixObject *self, PyObject *args, PyObject *kw_args)
 {
-	radix_node_t *node;
+	radix_node_t *node, *top;
+	prefix_t *prefix, prefix_buf;
 	PyObject *ret;
+	static char *keywords[] = { "network", "masklen", "packed", NULL };
 
-	if (!PyArg_ParseTuple(args, ":nodes"))
+	char *addr = NULL, *packed = NULL;
+	long prefixlen = -1;
+	Py_ssize_t packlen = -1;
+
+	NODES_ONLY(self, "search_covered");
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|sls#:search_covered",
+	    keywords, &addr, &prefixlen, &packed, &packlen))
+		return NULL;
+	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen,
+	    &prefix_buf)) == NULL)
 		return NULL;
 
 	if ((ret = PyList_New(0)) == NULL)
 		return NULL;
-
-	RADIX_WALK(self->rt4->head, node) {
-		if (node->data != NULL)
-			PyList_Append(ret, (PyObject *)node->data);
-	} RADIX_WALK_END;
-	RADIX_WALK(self->rt6->head, node) {
-		if (node->data != NULL)
-			PyList_Append(ret, (PyObject *)node->data);
+	if ((top = radix_search_subtree(PICKRT(prefix, self), prefix)) == NULL)
+		return (ret);
+	RADIX_WALK(top, node) {
+		if (node->data != NULL &&
+		    PyList_Append(ret, (PyObject *)node->data) == -1) {
+			Py_DECREF(ret);
+			return NULL;
+		}
 	} RADIX_WALK_END;
-
 	return (ret);
 }
 
-PyDoc_STRVAR(Radix_prefixes_doc,
-"Radix.prefixes(prefix) -> List of prefix strings\n\
+PyDoc_STRVAR(Radix_search_covering_doc,
+"Radix.search_covering(network[, masklen][, packed][, inclusive]\n\
+    -> List of RadixNode\n\
 \n\
-Returns a list containing all the prefixes that have been entered\n\
-into the tree. This list may be empty if no prefixes have been\n\
-entered.");
+Returns a list of the RadixNodes for every prefix in the tree that\n\
+covers the specified network, most specific first; the first entry is\n\
+the one search_best would return. If 'inclusive' is False, the network\n\
+itself is left out even if it is in the tree.");
 
 static PyObject *
-Radix_prefixes(RadixObject *self, PyObject *args)
+Radix_search_covering(RadixObject *self, PyObject *args, PyObject *kw_args)
 {
-	radix_node_t *node;
+	radix_node_t *nodes[RADIX_MAXBITS + 1];
+	prefix_t *prefix, prefix_buf;
 	PyObject *ret;
+	static char *keywords[] = { "network", "masklen", "packed",
+	    "inclusive", NULL };
 
-	if (!PyArg_ParseTuple(args, ":prefixes"))
+	char *addr = NULL, *packed = NULL;
+	long prefixlen = -1;
+	Py_ssize_t packlen = -1;
+	int inclusive = 1, i, n;
+
+	NODES_ONLY(self, "search_covering");
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args,
+	    "|sls#i:search_covering", keywords, &addr, &prefixlen, &packed,
+	    &packlen, &inclusive))
+		return NULL;
+	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen,
+	    &prefix_buf)) == NULL)
 		return NULL;
 
 	if ((ret = PyList_New(0)) == NULL)
 		return NULL;
-
-	RADIX_WALK(self->rt4->head, node) {
-		if (node->data != NULL) {
-			PyList_Append(ret,
-			    ((RadixNodeObject *)node->data)->prefix);
-		}
-	} RADIX_WALK_END;
-	RADIX_WALK(self->rt6->head, node) {
-		if (node->data != NULL) {
-			PyList_Append(ret,
-			    ((RadixNodeObject *)node->data)->prefix);
+	n = radix_search_covering(PICKRT(prefix, self), prefix, inclusive,
+	    nodes);
+	for (i = n - 1; i >= 0; i--) {
+		if (nodes[i]->data != NULL &&
+		    PyList_Append(ret, (PyObject *)nodes[i]->data) == -1) {
+			Py_DECREF(ret);
+			return NULL;
 		}
-	} RADIX_WALK_END;
-
+	}
 	return (ret);
 }
 
-/* Used for pickling */
+/* Fetch the C string behind an address object passed in a sequence */
+static const char *
+object_to_addr(PyObject *obj)
+{
+	char *addr;
+
+#if PY_MAJOR_VERSION >= 3
+	if (PyUnicode_Check(obj))
+		return (PyUnicode_AsUTF8(obj));
+#else
+	if (PyString_Check(obj))
+		return (PyString_AsString(obj));
+#endif
+	if (!PyArg_Parse(obj, "s", &addr))
+		return (NULL);
+	return (addr);
+}
+
+/*
+ * Best-match search for a batch of addresses, given either as parsed
+ * prefixes or as a buffer of packed addresses of a single family. Must
+ * be called with the GIL or the read lock held.
+ */
+static void
+search_best_batch(RadixObject *self, prefix_t *prefixes, u_char *packed,
+    int family, Py_ssize_t n, radix_node_t **nodes)
+{
+	prefix_t prefix;
+	radix_tree_t *rt;
+	Py_ssize_t i;
+	int addrlen;
+
+	if (prefixes != NULL) {
+		for (i = 0; i < n; i++) {
+			nodes[i] = radix_search_best(PICKRT((&prefixes[i]),
+			    self), &prefixes[i]);
+		}
+		return;
+	}
+	rt = (family == AF_INET6) ? self->rt6 : self->rt4;
+	addrlen = (family == AF_INET6) ? 16 : 4;
+	for (i = 0; i < n; i++) {
+		prefix_from_blob(packed + i * addrlen, addrlen, -1, &prefix);
+		nodes[i] = radix_search_best(rt, &prefix);
+	}
+}
+
+PyDoc_STRVAR(Radix_search_best_many_doc,
+"Radix.search_best_many([networks][, packed][, family]) -> List of RadixNode\n\
+\n\
+Performs a best-match search (as per Radix.search_best) for each of\n\
+a number of addresses in a single call. Returns a list holding the\n\
+matching RadixNode, or None, for each address in turn. For a mapping\n\
+or an IntRadix, it holds the matching values instead.\n\
+\n\
+The addresses may be given as a sequence of strings using 'networks',\n\
+or as a contiguous buffer of packed binary addresses (a bytes object,\n\
+array, etc.) using 'packed'. Packed addresses are assumed to be of\n\
+the address family specified by 'family' (default socket.AF_INET).\n\
+\n\
+Large batches are searched without holding the GIL, so that several\n\
+threads may search the same tree concurrently.");
+
+static PyObject *
+Radix_search_best_many(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	radix_node_t **nodes = NULL;
+	prefix_t *prefixes = NULL;
+	static char *keywords[] = { "networks", "packed", "family", NULL };
+	PyObject *networks = NULL, *packed = NULL, *seq, *ret = NULL, *item;
+	Py_buffer view;
+	Py_ssize_t i, n;
+	const char *errmsg, *addr;
+	int family = AF_INET, addrlen, nogil;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args,
+	    "|OOi:search_best_many", keywords, &networks, &packed, &family))
+		return NULL;
+	if ((networks == NULL) == (packed == NULL)) {
+		PyErr_SetString(PyExc_TypeError, "Specify exactly one of "
+		    "'networks' or 'packed'");
+		return NULL;
+	}
+
+	view.buf = NULL;
+	if (networks != NULL) {
+		if ((seq = PySequence_Fast(networks,
+		    "'networks' must be a sequence")) == NULL)
+			return NULL;
+		n = PySequence_Fast_GET_SIZE(seq);
+		if ((prefixes = PyMem_Malloc((n + 1) *
+		    sizeof(*prefixes))) == NULL) {
+			Py_DECREF(seq);
+			return PyErr_NoMemory();
+		}
+		for (i = 0; i < n; i++) {
+			item = PySequence_Fast_GET_ITEM(seq, i);
+			if ((addr = object_to_addr(item)) == NULL)
+				break;
+			if (prefix_pton(addr, -1, &prefixes[i],
+			    &errmsg) == NULL) {
+				PyErr_SetString(PyExc_ValueError, errmsg ?
+				    errmsg : "Invalid address format");
+				break;
+			}
+		}
+		Py_DECREF(seq);
+		if (i < n)
+			goto out;
+	} else {
+		switch (family) {
+		case AF_INET:
+			addrlen = 4;
+			break;
+		case AF_INET6:
+			addrlen = 16;
+			break;
+		default:
+			PyErr_SetString(PyExc_ValueError,
+			    "Unsupported address family");
+			return NULL;
+		}
+		if (PyObject_GetBuffer(packed, &view, PyBUF_SIMPLE) == -1)
+			return NULL;
+		if (view.len % addrlen != 0) {
+			PyErr_SetString(PyExc_ValueError,
+			    "Invalid packed address buffer length");
+			goto out;
+		}
+		n = view.len / addrlen;
+	}
+	if ((nodes = PyMem_Malloc((n + 1) * sizeof(*nodes))) == NULL) {
+		PyErr_NoMemory();
+		goto out;
+	}
+	if ((ret = PyList_New(n)) == NULL)
+		goto out;
+	radix_refresh_compiled(self, n);
+
+	/*
+	 * Walk the trees without the GIL for large batches. The read lock
+	 * is kept until the results have been converted, so that the nodes
+	 * cannot be removed underneath us.
+	 */
+	if ((nogil = (n >= RADIX_NOGIL_BATCH))) {
+		Py_BEGIN_ALLOW_THREADS
+		RADIX_RDLOCK(&self->lock);
+		search_best_batch(self, prefixes, view.buf, family, n, nodes);
+		Py_END_ALLOW_THREADS
+	} else
+		search_best_batch(self, prefixes, view.buf, family, n, nodes);
+
+	for (i = 0; i < n; i++) {
+		if (nodes[i] == NULL || !NODE_IN_USE(self, nodes[i])) {
+			item = Py_None;
+			Py_INCREF(item);
+		} else if ((item = node_result(self, nodes[i])) == NULL)
+			break;
+		PyList_SET_ITEM(ret, i, item);
+	}
+	if (nogil)
+		RADIX_RDUNLOCK(&self->lock);
+ out:
+	if (packed != NULL)
+		PyBuffer_Release(&view);
+	PyMem_Free(prefixes);
+	PyMem_Free(nodes);
+	if (PyErr_Occurred()) {
+		Py_XDECREF(ret);
+		return NULL;
+	}
+	return (ret);
+}
+
+/*
+ * Decode the element type of a buffer. Returns the size of its integer
+ * elements, or 0 if it does not hold integers, and sets *swap if they
+ * are not in native byte order.
+ */
+static int
+buffer_int_format(Py_buffer *view, int *swap)
+{
+	static const union { long l; char c[sizeof(long)]; } one = { 1 };
+	const char *fmt = view->format;
+	int little = one.c[0];
+
+	*swap = 0;
+	if (fmt == NULL)
+		return (0);
+	switch (*fmt) {
+	case '<':
+		*swap = !little;
+		fmt++;
+		break;
+	case '>':
+	case '!':
+		*swap = little;
+		fmt++;
+		break;
+	case '@':
+	case '=':
+		fmt++;
+		break;
+	}
+	if (fmt[0] == '\0' || fmt[1] != '\0' ||
+	    strchr("bBhHiIlLqQnN", fmt[0]) == NULL)
+		return (0);
+	return ((int)view->itemsize);
+}
+
+static u_int32_t
+swap32(u_int32_t v)
+{
+	return ((v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) |
+	    (v << 24));
+}
+
+/* What Radix.search_best_into() writes for each address */
+#define RESULT_PREFIXLEN	0
+#define RESULT_TAG		1
+#define RESULT_VALUE		2	/* IntRadix values */
+
+struct search_into_ctx {
+	radix_tree_t *rt;
+	int mode;		/* The tree's RADIX_MODE_* */
+	u_char *in;		/* Packed addresses */
+	int addrlen;
+	int in_ints;		/* Input is 32-bit integers, not bytes */
+	int in_swap;		/* ...in non-native byte order */
+	u_char *out;		/* Results */
+	int outsize;		/* Size of each result */
+	int result;		/* RESULT_* */
+	Py_ssize_t n;
+};
+
+/* Must be called with the GIL or the read lock held */
+static Py_ssize_t
+search_best_into(struct search_into_ctx *ctx)
+{
+	radix_node_t *node;
+	prefix_t prefix;
+	u_char addr[4];
+	u_int32_t v;
+	Py_ssize_t i, found = 0;
+	PY_LONG_LONG r;
+
+	for (i = 0; i < ctx->n; i++) {
+		if (ctx->in_ints) {
+			memcpy(&v, ctx->in + i * 4, 4);
+			if (ctx->in_swap)
+				v = swap32(v);
+			addr[0] = v >> 24;
+			addr[1] = v >> 16;
+			addr[2] = v >> 8;
+			addr[3] = v;
+			prefix_from_blob(addr, 4, -1, &prefix);
+		} else {
+			prefix_from_blob(ctx->in + i * ctx->addrlen,
+			    ctx->addrlen, -1, &prefix);
+		}
+		node = radix_search_best(ctx->rt, &prefix);
+		if (node == NULL || !NODE_IN_USE(ctx, node))
+			r = -1;
+		else {
+			found++;
+			if (ctx->result == RESULT_TAG)
+				r = ((RadixNodeObject *)node->data)->tag;
+			else if (ctx->result == RESULT_VALUE)
+				r = (PY_LONG_LONG)NODE_INT(node);
+			else
+				r = node->bit;
+		}
+		if (ctx->outsize == 4)
+			((int *)ctx->out)[i] = (int)r;
+		else
+			((PY_LONG_LONG *)ctx->out)[i] = r;
+	}
+	return (found);
+}
+
+PyDoc_STRVAR(Radix_search_best_into_doc,
+"Radix.search_best_into(packed, out[, family][, result]) -> int\n\
+\n\
+Performs a best-match search (as per Radix.search_best) for each of\n\
+the packed addresses in the buffer 'packed', writing one integer per\n\
+address into the writable buffer 'out' (e.g. a numpy int32 or int64\n\
+array, or an array.array). No Python objects are created per address.\n\
+\n\
+'family' gives the address family (default socket.AF_INET). IPv4\n\
+addresses may be packed as bytes in network order or, if 'packed' is\n\
+a buffer of 32-bit unsigned integers such as a numpy uint32 array, as\n\
+integers in that buffer's byte order. Other integer buffers are\n\
+refused.\n\
+\n\
+'result' selects what is written for a matching address: 'prefixlen'\n\
+(the default) for the length of the matching prefix, or 'tag' for the\n\
+RadixNode.tag integer of the matching node, or for an IntRadix 'value'\n\
+for the matching value, truncated to the size of the integers in 'out'.\n\
+-1 is written for addresses that do not match.\n\
+\n\
+Returns the number of addresses that matched.");
+
+static PyObject *
+Radix_search_best_into(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	struct search_into_ctx ctx;
+	static char *keywords[] = { "packed", "out", "family", "result", NULL };
+	PyObject *packed, *out;
+	Py_buffer inview, outview;
+	Py_ssize_t found = -1;
+	const char *result = "prefixlen";
+	int family = AF_INET, insize, swap;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args,
+	    "OO|is:search_best_into", keywords, &packed, &out, &family,
+	    &result))
+		return NULL;
+
+	memset(&ctx, '\0', sizeof(ctx));
+	switch (family) {
+	case AF_INET:
+		ctx.addrlen = 4;
+		break;
+	case AF_INET6:
+		ctx.addrlen = 16;
+		break;
+	default:
+		PyErr_SetString(PyExc_ValueError, "Unsupported address family");
+		return NULL;
+	}
+	if (strcmp(result, "prefixlen") == 0)
+		ctx.result = RESULT_PREFIXLEN;
+	else if (strcmp(result, "tag") == 0 &&
+	    self->mode == RADIX_MODE_NODES)
+		ctx.result = RESULT_TAG;
+	else if (strcmp(result, "value") == 0 &&
+	    self->mode == RADIX_MODE_INT)
+		ctx.result = RESULT_VALUE;
+	else {
+		PyErr_SetString(PyExc_ValueError, "result must be 'prefixlen', "
+		    "or 'tag' for RadixNodes or 'value' for an IntRadix");
+		return NULL;
+	}
+	ctx.mode = self->mode;
+
+	if (PyObject_GetBuffer(packed, &inview,
+	    PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == -1)
+		return NULL;
+	if (PyObject_GetBuffer(out, &outview,
+	    PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | PyBUF_WRITABLE) == -1) {
+		PyBuffer_Release(&inview);
+		return NULL;
+	}
+
+	insize = buffer_int_format(&inview, &swap);
+	if (family == AF_INET && insize == 4) {
+		ctx.in_ints = 1;
+		ctx.in_swap = swap;
+	} else if (insize > 1) {
+		PyErr_SetString(PyExc_ValueError, "packed must hold bytes, or "
+		    "32 bit integers for IPv4 addresses");
+		goto out;
+	}
+	if (inview.len % ctx.addrlen != 0) {
+		PyErr_SetString(PyExc_ValueError,
+		    "Invalid packed address buffer length");
+		goto out;
+	}
+	ctx.in = inview.buf;
+	ctx.n = inview.len / ctx.addrlen;
+
+	ctx.outsize = buffer_int_format(&outview, &swap);
+	if ((ctx.outsize != 4 && ctx.outsize != 8) || swap) {
+		PyErr_SetString(PyExc_TypeError, "out must be a buffer of "
+		    "native 32 or 64 bit integers");
+		goto out;
+	}
+	if (outview.len / ctx.outsize < ctx.n) {
+		PyErr_SetString(PyExc_ValueError,
+		    "out is too small for the number of addresses");
+		goto out;
+	}
+	ctx.out = outview.buf;
+	if (family == AF_INET6)
+		radix_refresh_compiled(self, ctx.n);
+
+	/*
+	 * Pick the tree once it can't change: a writer may have replaced it
+	 * with a copy while the GIL was dropped, and freed it with the last
+	 * snapshot sharing it.
+	 */
+	if (ctx.n >= RADIX_NOGIL_BATCH) {
+		Py_BEGIN_ALLOW_THREADS
+		RADIX_RDLOCK(&self->lock);
+		ctx.rt = (family == AF_INET6) ? self->rt6 : self->rt4;
+		found = search_best_into(&ctx);
+		RADIX_RDUNLOCK(&self->lock);
+		Py_END_ALLOW_THREADS
+	} else {
+		ctx.rt = (family == AF_INET6) ? self->rt6 : self->rt4;
+		found = search_best_into(&ctx);
+	}
+ out:
+	PyBuffer_Release(&inview);
+	PyBuffer_Release(&outview);
+	if (found == -1)
+		return NULL;
+	return PyInt_FromLong((long)found);
+}
+
+/*
+ * Order prefixes as a walk of the tree visits them: by family, then
+ * address, with a covering prefix ahead of the ones it covers.
+ */
+static int
+prefix_cmp(prefix_t *a, prefix_t *b)
+{
+	int r;
+
+	if (a->family != b->family)
+		return (a->family < b->family ? -1 : 1);
+	if ((r = memcmp(&a->add, &b->add,
+	    a->family == AF_INET6 ? 16 : 4)) != 0)
+		return (r);
+	if (a->bitlen != b->bitlen)
+		return (a->bitlen < b->bitlen ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Add one prefix of a bulk load. While the input stays sorted, the
+ * insertion resumes from the node added last rather than from the head.
+ */
+static RadixNodeObject *
+add_many_one(RadixObject *self, prefix_t *prefix, prefix_t *last,
+    struct add_hint *hint)
+{
+	if (hint->node != NULL && prefix_cmp(last, prefix) > 0)
+		hint->node = NULL;
+	*last = *prefix;
+	return ((RadixNodeObject *)create_add_node(self, prefix, hint));
+}
+
+/* As add_many_one, storing the data of a mapping's prefix */
+static int
+add_many_set(RadixObject *self, prefix_t *prefix, prefix_t *last,
+    struct add_hint *hint, PyObject *value)
+{
+	void *data;
+
+	if (object_to_data(self, value, &data) == -1)
+		return (-1);
+	if (hint->node != NULL && prefix_cmp(last, prefix) > 0)
+		hint->node = NULL;
+	*last = *prefix;
+	return (mapping_set(self, prefix, data, hint));
+}
+
+/*
+ * Add the networks, or (network, data) pairs, yielded by an iterable.
+ * A mapping takes (network, value) pairs.
+ */
+static int
+add_many_iter(RadixObject *self, PyObject *networks)
+{
+	struct add_hint hint = { NULL, 0 };
+	prefix_t prefix, last;
+	RadixNodeObject *node;
+	PyObject *iter, *item, *addr, *data;
+	const char *errmsg, *addr_string;
+	int ret = -1;
+
+	if ((iter = PyObject_GetIter(networks)) == NULL)
+		return (-1);
+	while ((item = PyIter_Next(iter)) != NULL) {
+		data = NULL;
+		if (PyTuple_Check(item)) {
+			if (!PyArg_ParseTuple(item, "OO;items must be networks "
+			    "or (network, data) pairs", &addr, &data))
+				goto out;
+		} else if (self->mode != RADIX_MODE_NODES) {
+			PyErr_SetString(PyExc_TypeError,
+			    "items must be (network, value) pairs");
+			goto out;
+		} else
+			addr = item;
+		if ((addr_string = object_to_addr(addr)) == NULL)
+			goto out;
+		if (prefix_pton(addr_string, -1, &prefix, &errmsg) == NULL) {
+			PyErr_SetString(PyExc_ValueError, errmsg ? errmsg :
+			    "Invalid address format");
+			goto out;
+		}
+		if (self->mode != RADIX_MODE_NODES) {
+			if (add_many_set(self, &prefix, &last, &hint,
+			    data) == -1)
+				goto out;
+			Py_DECREF(item);
+			continue;
+		}
+		if ((node = add_many_one(self, &prefix, &last, &hint)) == NULL)
+			goto out;
+		if (data != NULL && data != Py_None) {
+			if (node->user_attr == NULL &&
+			    (node->user_attr = PyDict_New()) == NULL) {
+				Py_DECREF(node);
+				goto out;
+			}
+			if (PyDict_Merge(node->user_attr, data, 1) == -1) {
+				Py_DECREF(node);
+				goto out;
+			}
+		}
+		Py_DECREF(node);
+		Py_DECREF(item);
+	}
+	item = NULL;
+	if (!PyErr_Occurred())
+		ret = 0;
+ out:
+	Py_XDECREF(item);
+	Py_DECREF(iter);
+	return (ret);
+}
+
+/*
+ * Add the addresses in a buffer of packed addresses of one family. A
+ * mapping takes a sequence of as many values.
+ */
+static int
+add_many_packed(RadixObject *self, PyObject *packed, int family,
+    long masklen, PyObject *values)
+{
+	struct add_hint hint = { NULL, 0 };
+	prefix_t prefix, last;
+	RadixNodeObject *node;
+	PyObject *seq = NULL;
+	Py_buffer view;
+	Py_ssize_t i;
+	int addrlen, ret = -1;
+
+	if ((values == NULL) != (self->mode == RADIX_MODE_NODES)) {
+		PyErr_SetString(PyExc_TypeError, values == NULL ?
+		    "A mapping needs 'values' for 'packed'" :
+		    "'values' needs a mapping");
+		return (-1);
+	}
+
+	switch (family) {
+	case AF_INET:
+		addrlen = 4;
+		break;
+	case AF_INET6:
+		addrlen = 16;
+		break;
+	default:
+		PyErr_SetString(PyExc_ValueError, "Unsupported address family");
+		return (-1);
+	}
+	if (PyObject_GetBuffer(packed, &view, PyBUF_SIMPLE) == -1)
+		return (-1);
+	if (view.len % addrlen != 0) {
+		PyErr_SetString(PyExc_ValueError,
+		    "Invalid packed address buffer length");
+		goto out;
+	}
+	if (values != NULL) {
+		if ((seq = PySequence_Fast(values,
+		    "'values' must be a sequence")) == NULL)
+			goto out;
+		if (PySequence_Fast_GET_SIZE(seq) != view.len / addrlen) {
+			PyErr_SetString(PyExc_ValueError, "'values' must hold "
+			    "one value per address");
+			goto out;
+		}
+	}
+	for (i = 0; i < view.len / addrlen; i++) {
+		if (prefix_from_blob((u_char *)view.buf + i * addrlen,
+		    addrlen, masklen, &prefix) == NULL) {
+			PyErr_SetString(PyExc_ValueError,
+			    "Invalid packed address format");
+			goto out;
+		}
+		if (seq != NULL) {
+			if (add_many_set(self, &prefix, &last, &hint,
+			    PySequence_Fast_GET_ITEM(seq, i)) == -1)
+				goto out;
+			continue;
+		}
+		if ((node = add_many_one(self, &prefix, &last, &hint)) == NULL)
+			goto out;
+		Py_DECREF(node);
+	}
+	ret = 0;
+ out:
+	Py_XDECREF(seq);
+	PyBuffer_Release(&view);
+	return (ret);
+}
+
+PyDoc_STRVAR(Radix_add_many_doc,
+"Radix.add_many([networks][, packed][, masklen][, family][, values])\n\
+    -> None\n\
+\n\
+Adds a number of networks to the radix tree, as per Radix.add, in a\n\
+single call. 'networks' may be any iterable of network strings or of\n\
+(network, data) pairs, in which case the contents of the 'data' dict\n\
+are copied into the new RadixNode's data dict.\n\
+\n\
+Alternately, 'packed' may be a contiguous buffer of packed binary\n\
+addresses of the family 'family' (default socket.AF_INET), each of\n\
+which is added with a mask length of 'masklen' (default host length).\n\
+\n\
+A mapping or an IntRadix is given (network, value) pairs, or with\n\
+'packed', a sequence of as many 'values', and stores each value as\n\
+tree[network] = value would.\n\
+\n\
+Loading is fastest when the networks are sorted by address.");
+
+static PyObject *
+Radix_add_many(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "networks", "packed", "masklen", "family",
+	    "values", NULL };
+	PyObject *networks = NULL, *packed = NULL, *values = NULL;
+	long masklen = -1;
+	int family = AF_INET, r;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|OOliO:add_many",
+	    keywords, &networks, &packed, &masklen, &family, &values))
+		return NULL;
+	if ((networks == NULL) == (packed == NULL)) {
+		PyErr_SetString(PyExc_TypeError, "Specify exactly one of "
+		    "'networks' or 'packed'");
+		return NULL;
+	}
+	if (networks != NULL && values != NULL) {
+		PyErr_SetString(PyExc_TypeError,
+		    "'values' may only be given with 'packed'");
+		return NULL;
+	}
+	if (networks != NULL)
+		r = add_many_iter(self, networks);
+	else
+		r = add_many_packed(self, packed, family, masklen, values);
+	if (r == -1)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/* One operation of an update */
+struct update_op {
+	prefix_t prefix;
+	PyObject *data;		/* RadixNode data to merge, or NULL */
+	void *value;		/* Mapping value, or IntRadix integer */
+	Py_ssize_t seq;		/* Position in the input */
+	RadixNodeObject *node_obj;	/* RadixNode added */
+};
+
+/* Sort operations as prefix_cmp does, keeping repeats in input order */
+static int
+update_op_cmp(const void *a, const void *b)
+{
+	struct update_op *x = (struct update_op *)a;
+	struct update_op *y = (struct update_op *)b;
+	int r;
+
+	if ((r = prefix_cmp(&x->prefix, &y->prefix)) != 0)
+		return (r);
+	return (x->seq < y->seq ? -1 : x->seq > y->seq);
+}
+
+/*
+ * Parse the adds, or the deletes, of an update into an array of
+ * operations sorted for a walk of the tree. The objects in the array are
+ * borrowed from *seq, which the caller releases along with the array.
+ */
+static int
+update_parse(RadixObject *self, PyObject *items, int adds, PyObject **seq,
+    struct update_op **opsp, Py_ssize_t *np)
+{
+	struct update_op *ops;
+	PyObject *item, *addr, *data;
+	const char *errmsg, *addr_string;
+	Py_ssize_t i, n;
+
+	if (items == NULL || items == Py_None)
+		return (0);
+	if (adds && PyDict_Check(items))
+		*seq = PyDict_Items(items);
+	else
+		*seq = PySequence_Fast(items, adds ?
+		    "'adds' must be iterable" : "'deletes' must be iterable");
+	if (*seq == NULL)
+		return (-1);
+	n = PySequence_Fast_GET_SIZE(*seq);
+	if ((ops = PyMem_Malloc(n > 0 ? n * sizeof(*ops) : 1)) == NULL) {
+		PyErr_NoMemory();
+		return (-1);
+	}
+	*opsp = ops;
+	for (i = 0; i < n; i++) {
+		item = PySequence_Fast_GET_ITEM(*seq, i);
+		data = NULL;
+		if (adds && PyTuple_Check(item)) {
+			if (!PyArg_ParseTuple(item, "OO;items must be networks "
+			    "or (network, data) pairs", &addr, &data))
+				return (-1);
+		} else if (adds && self->mode != RADIX_MODE_NODES) {
+			PyErr_SetString(PyExc_TypeError,
+			    "items must be (network, value) pairs");
+			return (-1);
+		} else
+			addr = item;
+		if ((addr_string = object_to_addr(addr)) == NULL)
+			return (-1);
+		if (prefix_pton(addr_string, -1, &ops[i].prefix,
+		    &errmsg) == NULL) {
+			PyErr_SetString(PyExc_ValueError, errmsg ? errmsg :
+			    "Invalid address format");
+			return (-1);
+		}
+		ops[i].data = NULL;
+		ops[i].value = NULL;
+		ops[i].seq = i;
+		ops[i].node_obj = NULL;
+		if (self->mode != RADIX_MODE_NODES) {
+			if (data != NULL &&
+			    object_to_data(self, data, &ops[i].value) == -1)
+				return (-1);
+		} else if (data != NULL && data != Py_None)
+			ops[i].data = data;
+		*np = i + 1;
+	}
+	qsort(ops, n, sizeof(*ops), update_op_cmp);
+	return (0);
+}
+
+/*
+ * Apply the deletes, then the adds, of an update in one go under the
+ * write lock. Replaced and deleted RadixNodes or values are left in
+ * "released" for the caller to let go of once the lock is dropped.
+ */
+static void
+update_apply(RadixObject *self, struct update_op *dels, Py_ssize_t ndels,
+    struct update_op *adds, Py_ssize_t nadds, PyObject **released,
+    Py_ssize_t *nreleased, Py_ssize_t *applied)
+{
+	radix_tree_t *rt;
+	radix_node_t *node, *last = NULL;
+	prefix_t *prefix;
+	Py_ssize_t i;
+
+	for (i = 0; i < ndels; i++) {
+		prefix = &dels[i].prefix;
+		rt = PICKRT(prefix, self);
+		if ((node = radix_search_exact(rt, prefix)) != NULL) {
+			if (self->mode != RADIX_MODE_INT && node->data != NULL)
+				released[(*nreleased)++] = node->data;
+			radix_remove(rt, node);
+			(*applied)++;
+		}
+	}
+	/* Sorted, each insertion resumes from the one before */
+	for (i = 0; i < nadds; i++) {
+		prefix = &adds[i].prefix;
+		rt = PICKRT(prefix, self);
+		if (last != NULL && last->family != prefix->family)
+			last = NULL;
+		if ((node = radix_lookup_hint(rt, prefix, last)) == NULL)
+			continue;
+		switch (self->mode) {
+		case RADIX_MODE_NODES:
+			/* RadixNodes aren't tracked by the GC: no Python runs */
+			if (node->data == NULL &&
+			    (node->data = newRadixNodeObject(node)) == NULL) {
+				PyErr_Clear();
+				radix_remove(rt, node);
+				last = NULL;
+				continue;
+			}
+			adds[i].node_obj = node->data;
+			Py_INCREF(adds[i].node_obj);
+			break;
+		case RADIX_MODE_MAP:
+			if (node->data != NULL)
+				released[(*nreleased)++] = node->data;
+			Py_INCREF((PyObject *)adds[i].value);
+			node->data = adds[i].value;
+			break;
+		default:
+			node->data = adds[i].value;
+			break;
+		}
+		last = node;
+		(*applied)++;
+	}
+}
+
+PyDoc_STRVAR(Radix_update_doc,
+"Radix.update([adds][, deletes]) -> (applied, failed)\n\
+\n\
+Applies a batch of changes to the tree as one. 'deletes' is an iterable\n\
+of networks to delete, and 'adds' one of networks to add, as taken by\n\
+add_many: (network, data) pairs may give data to copy into the\n\
+RadixNode's data dict, and a mapping or an IntRadix takes (network,\n\
+value) pairs or a dict. The deletes are applied before the adds.\n\
+\n\
+All the networks are parsed before the tree is changed, so that a bad\n\
+one leaves the tree as it was. The changes are then made, sorted by\n\
+address, without other threads seeing the tree in between and with a\n\
+single change to the tree as far as iterations are concerned.\n\
+\n\
+Returns the number of changes applied and the number that failed:\n\
+deletes of networks not in the tree, or adds that ran out of memory.");
+
+static PyObject *
+Radix_update(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "adds", "deletes", NULL };
+	PyObject *adds = NULL, *deletes = NULL, *add_seq = NULL;
+	PyObject *del_seq = NULL, *ret = NULL, **released = NULL, *user_attr;
+	struct update_op *add_ops = NULL, *del_ops = NULL;
+	Py_ssize_t nadds = 0, ndels = 0, nreleased = 0, applied = 0, i;
+	RadixNodeObject *node_obj;
+	int need4, need6;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|OO:update",
+	    keywords, &adds, &deletes))
+		return NULL;
+	if (update_parse(self, adds, 1, &add_seq, &add_ops, &nadds) == -1 ||
+	    update_parse(self, deletes, 0, &del_seq, &del_ops, &ndels) == -1)
+		goto out;
+	if ((released = PyMem_Malloc((nadds + ndels) * sizeof(*released) +
+	    1)) == NULL) {
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	need4 = (nadds > 0 && add_ops[0].prefix.family == AF_INET) ||
+	    (ndels > 0 && del_ops[0].prefix.family == AF_INET);
+	need6 = (nadds > 0 && add_ops[nadds - 1].prefix.family == AF_INET6) ||
+	    (ndels > 0 && del_ops[ndels - 1].prefix.family == AF_INET6);
+	radix_wrlock(self);
+	/* Trees shared with snapshots are copied before anything changes */
+	if (((need4 || self->readonly) &&
+	    radix_writable(self, AF_INET) == -1) ||
+	    (need6 && radix_writable(self, AF_INET6) == -1)) {
+		RADIX_WRUNLOCK(&self->lock);
+		goto out;
+	}
+	update_apply(self, del_ops, ndels, add_ops, nadds, released,
+	    &nreleased, &applied);
+	if (applied > 0)
+		self->gen_id++;
+	RADIX_WRUNLOCK(&self->lock);
+
+	ret = Py_BuildValue("(nn)", applied, nadds + ndels - applied);
+	for (i = 0; ret != NULL && i < nadds; i++) {
+		if ((node_obj = add_ops[i].node_obj) == NULL ||
+		    add_ops[i].data == NULL)
+			continue;
+		if ((user_attr = node_obj->user_attr) == NULL &&
+		    (user_attr = node_obj->user_attr = PyDict_New()) == NULL)
+			Py_CLEAR(ret);
+		else if (PyDict_Merge(user_attr, add_ops[i].data, 1) == -1)
+			Py_CLEAR(ret);
+	}
+ out:
+	for (i = 0; i < nadds; i++)
+		Py_XDECREF(add_ops[i].node_obj);
+	for (i = 0; i < nreleased; i++)
+		Py_DECREF(released[i]);
+	PyMem_Free(released);
+	PyMem_Free(add_ops);
+	PyMem_Free(del_ops);
+	Py_XDECREF(add_seq);
+	Py_XDECREF(del_seq);
+	return (ret);
+}
+
+/* Format the prefix of a radix.c node as a string */
+static PyObject *
+node_prefix_string(radix_node_t *node)
+{
+	prefix_t prefix;
+
+	radix_node_prefix(node, &prefix);
+	return prefix_to_string(&prefix);
+}
+
+/*
+ * Returns a list of the RadixNodes, or the prefix strings, in both trees.
+ * The list is sized up front from the trees' prefix counts.
+ */
+static PyObject *
+radix_list(RadixObject *self, int prefixes)
+{
+	radix_tree_t *rts[2];
+	radix_node_t *node;
+	PyObject *ret, *item;
+	Py_ssize_t i = 0, n;
+	int t, r;
+
+	rts[0] = self->rt4;
+	rts[1] = self->rt6;
+	n = self->rt4->num_prefixes + self->rt6->num_prefixes;
+	if ((ret = PyList_New(n)) == NULL)
+		return NULL;
+	for (t = 0; t < 2; t++) {
+		RADIX_WALK(rts[t]->head, node) {
+			if (NODE_IN_USE(self, node)) {
+				if (prefixes)
+					item = node_prefix_string(node);
+				else {
+					item = node->data;
+					Py_INCREF(item);
+				}
+				if (item == NULL) {
+					Py_DECREF(ret);
+					return NULL;
+				}
+				if (i < n)
+					PyList_SET_ITEM(ret, i, item);
+				else {
+					r = PyList_Append(ret, item);
+					Py_DECREF(item);
+					if (r == -1) {
+						Py_DECREF(ret);
+						return NULL;
+					}
+				}
+				i++;
+			}
+		} RADIX_WALK_END;
+	}
+	if (i < n && PyList_SetSlice(ret, i, n, NULL) == -1) {
+		Py_DECREF(ret);
+		return NULL;
+	}
+	return (ret);
+}
+
+PyDoc_STRVAR(Radix_nodes_doc,
+"Radix.nodes(prefix) -> List of RadixNode\n\
+\n\
+Returns a list containing all the RadixNode objects that have been\n\
+entered into the tree. This list may be empty if no prefixes have\n\
+been entered.");
+
+static PyObject *
+Radix_nodes(RadixObject *self, PyObject *args)
+{
+	NODES_ONLY(self, "nodes");
+	if (!PyArg_ParseTuple(args, ":nodes"))
+		return NULL;
+	return (radix_list(self, 0));
+}
+
+PyDoc_STRVAR(Radix_prefixes_doc,
+"Radix.prefixes(prefix) -> List of prefix strings\n\
+\n\
+Returns a list containing all the prefixes that have been entered\n\
+into the tree. This list may be empty if no prefixes have been\n\
+entered.");
+
+static PyObject *
+Radix_prefixes(RadixObject *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args, ":prefixes"))
+		return NULL;
+	return (radix_list(self, 1));
+}
+
+/* Used for pickling */
+static int
+getstate_add(PyObject *ret, radix_node_t *node)
+{
+	RadixNodeObject *rnode = node->data;
+	char buf[256];
+	prefix_t prefix;
+	PyObject *item_tuple, *data;
+	int r;
+
+	radix_node_prefix(node, &prefix);
+	if (prefix_ntop(&prefix, buf, sizeof(buf)) == NULL) {
+		PyErr_SetString(PyExc_ValueError, "Couldn't format prefix");
+		return (-1);
+	}
+	/* Nodes whose data was never touched get an empty dict */
+	if ((data = rnode->user_attr) != NULL)
+		Py_INCREF(data);
+	else if ((data = PyDict_New()) == NULL)
+		return (-1);
+	/* Pickled prefixes are always bytes */
+	item_tuple = Py_BuildValue("(NN)", PyBytes_FromString(buf), data);
+	if (item_tuple == NULL)
+		return (-1);
+	r = PyList_Append(ret, item_tuple);
+	Py_DECREF(item_tuple);
+	return (r);
+}
+
+static PyObject *
+radix_getstate(RadixObject *self)
+{
+	radix_node_t *node;
+	PyObject *ret;
+
+	if ((ret = PyList_New(0)) == NULL)
+		return NULL;
+
+	RADIX_WALK(self->rt4->head, node) {
+		if (node->data != NULL && getstate_add(ret, node) == -1) {
+			Py_DECREF(ret);
+			return NULL;
+		}
+	} RADIX_WALK_END;
+	RADIX_WALK(self->rt6->head, node) {
+		if (node->data != NULL && getstate_add(ret, node) == -1) {
+			Py_DECREF(ret);
+			return NULL;
+		}
+	} RADIX_WALK_END;
+
+	return (ret);
+}
+
+static PyObject *
+Radix_getstate(RadixObject *self, PyObject *args)
+{
+	NODES_ONLY(self, "__getstate__");
+	if (!PyArg_ParseTuple(args, ":__getstate__"))
+		return NULL;
+	return radix_getstate(self);
+}
+
+/*
+ * Pickled state: a header and snapshots of the IPv4 and IPv6 trees (see
+ * radix_snapshot), followed by a list holding the data dict, or None if
+ * it was never used, of each prefix in the order the snapshots hold them.
+ * The header is a magic string, a version byte and the big-endian
+ * lengths of the two snapshots.
+ */
+#define RADIX_STATE_MAGIC	"RDX"
+#define RADIX_STATE_VERSION	1
+#define RADIX_STATE_HDR		12
+
+static void
+put_be32(u_char *p, size_t v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static size_t
+get_be32(u_char *p)
+{
+	return (((size_t)p[0] << 24) | ((size_t)p[1] << 16) |
+	    ((size_t)p[2] << 8) | p[3]);
+}
+
+static PyObject *
+radix_snapshot_state(RadixObject *self)
+{
+	radix_tree_t *rts[2];
+	radix_node_t *node;
+	RadixNodeObject *node_obj;
+	PyObject *blob, *payload, *data;
+	size_t lens[2];
+	u_char *p;
+	int i;
+
+	rts[0] = self->rt4;
+	rts[1] = self->rt6;
+	for (i = 0; i < 2; i++) {
+		if ((lens[i] = radix_snapshot(rts[i], NULL)) > 0xffffffffUL) {
+			PyErr_SetString(PyExc_OverflowError,
+			    "Tree too large to pickle");
+			return NULL;
+		}
+	}
+	if ((blob = PyBytes_FromStringAndSize(NULL,
+	    RADIX_STATE_HDR + lens[0] + lens[1])) == NULL)
+		return NULL;
+	p = (u_char *)PyBytes_AS_STRING(blob);
+	memcpy(p, RADIX_STATE_MAGIC, 3);
+	p[3] = RADIX_STATE_VERSION;
+	put_be32(p + 4, lens[0]);
+	put_be32(p + 8, lens[1]);
+	p += RADIX_STATE_HDR;
+	for (i = 0; i < 2; i++)
+		p += radix_snapshot(rts[i], p);
+
+	if ((payload = PyList_New(0)) == NULL) {
+		Py_DECREF(blob);
+		return NULL;
+	}
+	for (i = 0; i < 2; i++) {
+		RADIX_WALK(rts[i]->head, node) {
+			node_obj = node->data;
+			if (self->mode == RADIX_MODE_INT)
+				data = PyInt_FromSize_t((size_t)NODE_INT(node));
+			else if (self->mode == RADIX_MODE_MAP)
+				data = node->data;
+			else if (node_obj == NULL || node_obj->user_attr == NULL)
+				data = Py_None;
+			else
+				data = node_obj->user_attr;
+			if (data == NULL || PyList_Append(payload, data) == -1) {
+				if (self->mode == RADIX_MODE_INT)
+					Py_XDECREF(data);
+				Py_DECREF(blob);
+				Py_DECREF(payload);
+				return NULL;
+			}
+			if (self->mode == RADIX_MODE_INT)
+				Py_DECREF(data);
+		} RADIX_WALK_END;
+	}
+	return (Py_BuildValue("(NN)", blob, payload));
+}
+
+static PyObject *
+Radix_reduce(RadixObject *self, PyObject *args)
+{
+	PyObject *state, *ret;
+
+	if (!PyArg_ParseTuple(args, ":__reduce__"))
+		return NULL;
+	if ((state = radix_snapshot_state(self)) == NULL)
+		return NULL;
+
+	if (self->mode == RADIX_MODE_MAP)
+		ret = Py_BuildValue("(O(O)O)", radix_constructor, Py_True, state);
+	else if (self->mode == RADIX_MODE_INT)
+		ret = Py_BuildValue("(O()O)", intradix_constructor, state);
+	else
+		ret = Py_BuildValue("(O()O)", radix_constructor, state);
+	Py_XDECREF(state);
+
+	return ret;
+}
+
+/* Give a restored prefix its RadixNode and pickled data dict, if any */
+static int
+restore_node(radix_node_t *node, PyObject *data)
+{
+	RadixNodeObject *node_obj;
+
+	if (data != Py_None && !PyDict_Check(data)) {
+		PyErr_SetString(PyExc_ValueError, "Invalid pickled state");
+		return (-1);
+	}
+	if ((node_obj = newRadixNodeObject(node)) == NULL)
+		return (-1);
+	if (data != Py_None) {
+		Py_INCREF(data);
+		node_obj->user_attr = data;
+	}
+	node->data = node_obj;
+	return (0);
+}
+
+/*
+ * Load state written by radix_snapshot_state. The trees are rebuilt on
+ * the side and then swapped in, or merged if this tree isn't empty.
+ */
+static int
+radix_restore_state(RadixObject *self, PyObject *blob, PyObject *payload)
+{
+	struct add_hint hint;
+	radix_tree_t *rts[2], *tmp;
+	radix_node_t *node;
+	RadixNodeObject *node_obj, *new_obj;
+	PyObject *data;
+	prefix_t prefix;
+	const char *errmsg;
+	size_t len, lens[2];
+	Py_ssize_t n = 0;
+	u_char *p;
+	int i, ret = -1;
+
+	p = (u_char *)PyBytes_AS_STRING(blob);
+	len = PyBytes_GET_SIZE(blob);
+	if (len < RADIX_STATE_HDR || memcmp(p, RADIX_STATE_MAGIC, 3) != 0) {
+		PyErr_SetString(PyExc_ValueError, "Invalid pickled state");
+		return (-1);
+	}
+	if (p[3] != RADIX_STATE_VERSION) {
+		PyErr_Format(PyExc_ValueError,
+		    "Unsupported pickle version %d", p[3]);
+		return (-1);
+	}
+	lens[0] = get_be32(p + 4);
+	lens[1] = get_be32(p + 8);
+	len -= RADIX_STATE_HDR;
+	p += RADIX_STATE_HDR;
+	if (lens[0] > len || lens[1] != len - lens[0]) {
+		PyErr_SetString(PyExc_ValueError, "Invalid pickled state");
+		return (-1);
+	}
+
+	rts[0] = New_Radix(AF_INET);
+	rts[1] = New_Radix(AF_INET6);
+	if (rts[0] == NULL || rts[1] == NULL) {
+		PyErr_NoMemory();
+		goto out;
+	}
+	for (i = 0; i < 2; i++) {
+		if (radix_restore(rts[i], p, lens[i], &errmsg) == -1) {
+			PyErr_SetString(PyExc_ValueError, errmsg);
+			goto out;
+		}
+		p += lens[i];
+	}
+
+	/* Give every prefix its RadixNode and data, or its value */
+	for (i = 0; i < 2; i++) {
+		RADIX_WALK(rts[i]->head, node) {
+			if (n >= PyList_GET_SIZE(payload)) {
+				PyErr_SetString(PyExc_ValueError,
+				    "Invalid pickled state");
+				goto out;
+			}
+			data = PyList_GET_ITEM(payload, n++);
+			if (self->mode == RADIX_MODE_NODES) {
+				if (restore_node(node, data) == -1)
+					goto out;
+			} else if (object_to_data(self, data, &node->data) == -1)
+				goto out;
+			else if (self->mode == RADIX_MODE_MAP)
+				Py_INCREF(data);
+		} RADIX_WALK_END;
+	}
+	if (n != PyList_GET_SIZE(payload)) {
+		PyErr_SetString(PyExc_ValueError, "Invalid pickled state");
+		goto out;
+	}
+
+	radix_wrlock(self);
+	if (self->rt4->head == NULL && self->rt6->head == NULL) {
+		tmp = self->rt4;
+		self->rt4 = rts[0];
+		rts[0] = tmp;
+		tmp = self->rt6;
+		self->rt6 = rts[1];
+		rts[1] = tmp;
+		/* Stay compiled; without the memory, the tree still works */
+		if (rts[0]->dir24 != NULL)
+			radix_dir24_compile(self->rt4);
+		if (rts[1]->poptrie != NULL)
+			radix_poptrie_compile(self->rt6);
+		self->gen_id++;
+		RADIX_WRUNLOCK(&self->lock);
+		ret = 0;
+		goto out;
+	}
+	RADIX_WRUNLOCK(&self->lock);
+
+	/* Merge into the existing tree */
+	for (i = 0; i < 2; i++) {
+		hint.node = NULL;
+		RADIX_WALK(rts[i]->head, node) {
+			node_obj = node->data;
+			radix_node_prefix(node, &prefix);
+			if (self->mode != RADIX_MODE_NODES) {
+				if (mapping_set(self, &prefix, node->data,
+				    &hint) == -1)
+					goto out;
+			} else {
+				if ((new_obj = (RadixNodeObject *)create_add_node(
+				    self, &prefix, &hint)) == NULL)
+					goto out;
+				if (node_obj->user_attr != NULL) {
+					Py_XDECREF(new_obj->user_attr);
+					new_obj->user_attr = node_obj->user_attr;
+					node_obj->user_attr = NULL;
+				}
+				Py_DECREF(new_obj);
+			}
+		} RADIX_WALK_END;
+	}
+	ret = 0;
+ out:
+	for (i = 0; i < 2; i++) {
+		if (rts[i] != NULL)
+			radix_tree_release(rts[i], RELEASE_CB(self));
+	}
+	return (ret);
+}
+
+/* Used for unpickling */
+static PyObject *
+Radix_setstate(RadixObject *self, PyObject *args)
+{
+	PyObject *state, *tpl, *addr, *data, *blob, *payload;
+	int len, i;
+	RadixNodeObject *node;
+	prefix_t *prefix, prefix_buf;
+	struct add_hint hint = { NULL, 0 };
+	char *addr_string;
+	const char *errmsg;
+
+	if (!Radix_CheckExact(self)) {
+		PyErr_SetString(PyExc_ValueError, "not a Radix object");
+		return NULL;
+	}
+	if (self->readonly) {
+		PyErr_SetString(PyExc_TypeError, "Radix snapshot is read-only");
+		return NULL;
+	}
+
+	if (!PyArg_ParseTuple(args, "O:__setstate__", &state))
+		return NULL;
+	if (PyTuple_Check(state)) {
+		if (!PyArg_ParseTuple(state, "SO!:__setstate__", &blob,
+		    &PyList_Type, &payload))
+			return NULL;
+		if (radix_restore_state(self, blob, payload) == -1)
+			return NULL;
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+
+	/* Older pickles hold a list of (prefix string, data) tuples */
+	NODES_ONLY(self, "__setstate__");
+	if (!PyList_Check(state)) {
+		PyErr_SetString(PyExc_TypeError, "Invalid pickled state");
+		return NULL;
+	}
+
+	len = PyList_Size(state);
+	for (i = 0; i < len; i++) {
+		if ((tpl = PyList_GetItem(state, i)) == NULL)
+			return NULL;
+		if ((addr = PyTuple_GetItem(tpl, 0)) == NULL)
+			return NULL;
+		if ((data = PyTuple_GetItem(tpl, 1)) == NULL)
+			return NULL;
+		if ((addr_string = PyString_AsString(addr)) == NULL)
+			return NULL;
+		if ((prefix = prefix_pton(addr_string, -1, &prefix_buf,
+		    &errmsg)) == NULL) {
+			PyErr_SetString(PyExc_ValueError, errmsg ? errmsg :
+			    "Invalid address format");
+			return NULL;
+		}
+		if ((node = (RadixNodeObject *)create_add_node(self,
+		    prefix, &hint)) == NULL)
+			return NULL;
+		Py_XDECREF(node->user_attr);
+		node->user_attr = data;
+		Py_INCREF(node->user_attr);
+		Py_DECREF(node);
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/*
+ * Frozen tree buffer: this header, followed by the nodes of the IPv4
+ * tree and then those of the IPv6 tree (see radix_freeze).
+ */
+#define RADIX_FROZEN_MAGIC	"RDXF"
+#define RADIX_FROZEN_VERSION	1
+
+struct frozen_hdr {
+	char magic[4];
+	u_int32_t version;	/* Also reveals a foreign byte order */
+	u_int32_t num_nodes[2];
+};
+
+/*
+ * radix_freeze callback: a frozen node's value is its RadixNode's tag,
+ * or the node's own value in an IntRadix
+ */
+static int64_t
+frozen_node_tag(radix_node_t *rn, void *cbctx)
+{
+	RadixObject *self = cbctx;
+	RadixNodeObject *node = rn->data;
+
+	if (self->mode == RADIX_MODE_INT)
+		return ((int64_t)NODE_INT(rn));
+	return (node != NULL ? node->tag : 0);
+}
+
+PyDoc_STRVAR(Radix_freeze_doc,
+"Radix.freeze() -> bytes\n\
+\n\
+Returns a frozen copy of the tree, holding its prefixes and their\n\
+RadixNode tags but not their data dicts. The copy contains no\n\
+pointers, so it may be written to a file and mapped into any number\n\
+of processes on the same machine; see radix.FrozenRadix. The tags of\n\
+a frozen IntRadix are its values.");
+
+static PyObject *
+Radix_freeze(RadixObject *self, PyObject *args)
+{
+	struct frozen_hdr *hdr;
+	radix_frozen_node_t *nodes;
+	PyObject *ret;
+	size_t len;
+	int n4, n6;
+
+	/* An IntRadix freezes with its values as the tags */
+	if (self->mode == RADIX_MODE_MAP) {
+		PyErr_SetString(PyExc_TypeError, "A mapping Radix can't be "
+		    "frozen, as its values are Python objects");
+		return NULL;
+	}
+	if (!PyArg_ParseTuple(args, ":freeze"))
+		return NULL;
+
+	n4 = self->rt4->num_active_node;
+	n6 = self->rt6->num_active_node;
+	len = sizeof(*hdr) + (size_t)(n4 + n6) * sizeof(*nodes);
+	/* Built aside, as bytes objects needn't be aligned for the nodes */
+	if ((hdr = PyMem_Malloc(len)) == NULL)
+		return PyErr_NoMemory();
+	memcpy(hdr->magic, RADIX_FROZEN_MAGIC, sizeof(hdr->magic));
+	hdr->version = RADIX_FROZEN_VERSION;
+	hdr->num_nodes[0] = n4;
+	hdr->num_nodes[1] = n6;
+	nodes = (radix_frozen_node_t *)(hdr + 1);
+	radix_freeze(self->rt4, nodes, frozen_node_tag, self);
+	radix_freeze(self->rt6, nodes + n4, frozen_node_tag, self);
+
+	ret = PyString_FromStringAndSize((char *)hdr, len);
+	PyMem_Free(hdr);
+	return ret;
+}
+
+PyDoc_STRVAR(Radix_compile_doc,
+"Radix.compile([enable]) -> None\n\
+\n\
+Builds compiled lookup tables for the prefixes in the tree, which answer\n\
+search_best for host addresses (and search_best_many and\n\
+search_best_into) without a walk of the tree.\n\
+\n\
+The IPv4 table finds a match with one or two table reads. It is kept\n\
+up to date as prefixes are added and deleted, and takes at least 64MB\n\
+of memory. The IPv6 table reads one small node for every 6 bits of the\n\
+matching prefix. It is rebuilt, not updated, when the tree changes:\n\
+searches walk the tree until enough of them have been made to pay for\n\
+a rebuild, or until compile() is called again.\n\
+\n\
+Both are best kept for large, read-mostly tables. compile(False)\n\
+discards them.");
+
+static PyObject *
+Radix_compile(RadixObject *self, PyObject *args)
+{
+	int enable = 1, r = 0;
+
+	if (!PyArg_ParseTuple(args, "|i:compile", &enable))
+		return NULL;
+	radix_wrlock(self);
+	/* Snapshots may be compiled too, but not the trees they share */
+	if (radix_unshare(self, AF_INET) == -1 ||
+	    radix_unshare(self, AF_INET6) == -1) {
+		RADIX_WRUNLOCK(&self->lock);
+		return NULL;
+	}
+	if (!enable) {
+		if (self->rt4->dir24 != NULL)
+			radix_dir24_free(self->rt4);
+		if (self->rt6->poptrie != NULL)
+			radix_poptrie_free(self->rt6);
+	} else {
+		r = radix_dir24_compile(self->rt4);
+		if (radix_poptrie_compile(self->rt6) == -1)
+			r = -1;
+	}
+	self->stale_searches = 0;
+	RADIX_WRUNLOCK(&self->lock);
+	if (r == -1)
+		return PyErr_NoMemory();
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/*
+ * Make an iterator over the tree for iter_nodes or iter_prefixes, limited
+ * to one family or to the prefixes covered by a network
+ */
+static PyObject *
+radix_iter(RadixObject *self, PyObject *args, PyObject *kw_args,
+    const char *fmt, int prefixes)
+{
+	radix_node_t *top = NULL;
+	prefix_t *prefix = NULL, prefix_buf;
+	static char *keywords[] = { "network", "masklen", "packed", "family",
+	    NULL };
+
+	char *addr = NULL, *packed = NULL;
+	long prefixlen = -1;
+	Py_ssize_t packlen = -1;
+	int family = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, fmt, keywords,
+	    &addr, &prefixlen, &packed, &packlen, &family))
+		return NULL;
+	if (addr != NULL || packed != NULL) {
+		if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen,
+		    &prefix_buf)) == NULL)
+			return NULL;
+		if (family == 0)
+			family = prefix->family;
+	}
+	if (family != 0 && family != AF_INET && family != AF_INET6) {
+		PyErr_SetString(PyExc_ValueError, "Unsupported address family");
+		return NULL;
+	}
+	if (prefix != NULL && family != (int)prefix->family) {
+		PyErr_SetString(PyExc_ValueError,
+		    "family does not match the network");
+		return NULL;
+	}
+
+	if (prefix != NULL)
+		top = radix_search_subtree(PICKRT(prefix, self), prefix);
+	else if (family != 0)
+		top = (family == AF_INET6) ? self->rt6->head : self->rt4->head;
+	return (PyObject *)newRadixIterObject(self, family, top, prefixes);
+}
+
+PyDoc_STRVAR(Radix_iter_nodes_doc,
+"Radix.iter_nodes([network][, masklen][, packed][, family])\n\
+    -> Iterator of RadixNode\n\
+\n\
+Returns an iterator over the RadixNodes in the tree, in the same order\n\
+as nodes() but without building a list. If 'family' is given, only\n\
+prefixes of that address family are returned. If a network is given,\n\
+only the prefixes it covers are returned, as by search_covered().\n\
+As when iterating over the tree itself, the tree must not be modified\n\
+while the iterator is in use.");
+
+static PyObject *
+Radix_iter_nodes(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	NODES_ONLY(self, "iter_nodes");
+	return (radix_iter(self, args, kw_args, "|sls#i:iter_nodes", 0));
+}
+
+PyDoc_STRVAR(Radix_iter_prefixes_doc,
+"Radix.iter_prefixes([network][, masklen][, packed][, family])\n\
+    -> Iterator of prefix strings\n\
+\n\
+As iter_nodes(), but returns the prefixes as strings, like prefixes().");
+
+static PyObject *
+Radix_iter_prefixes(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	return (radix_iter(self, args, kw_args, "|sls#i:iter_prefixes", 1));
+}
+
+/* Mapping interface, for trees made by radix.Radix(mapping=True) */
+
+/* Parse a key: a network string in CIDR format, or a host address */
+static prefix_t *
+mapping_key(RadixObject *self, PyObject *key, prefix_t *prefix_buf)
+{
+	prefix_t *prefix;
+	const char *addr, *errmsg;
+
+	if (self->mode == RADIX_MODE_NODES) {
+		PyErr_SetString(PyExc_TypeError, "Radix is not a mapping; "
+		    "create it with Radix(mapping=True) or IntRadix()");
+		return (NULL);
+	}
+	if ((addr = object_to_addr(key)) == NULL)
+		return (NULL);
+	if ((prefix = prefix_pton(addr, -1, prefix_buf, &errmsg)) == NULL) {
+		PyErr_SetString(PyExc_ValueError, errmsg ? errmsg :
+		    "Invalid address format");
+	}
+	return (prefix);
+}
+
+/*
+ * Find the node holding the value for a key, by best or exact match.
+ * Returns 0 and sets *nodep, to NULL if nothing matches, or -1 if the
+ * key is bad.
+ */
+static int
+mapping_search(RadixObject *self, PyObject *key, int exact,
+    radix_node_t **nodep)
+{
+	prefix_t *prefix, prefix_buf;
+	radix_node_t *node;
+
+	if ((prefix = mapping_key(self, key, &prefix_buf)) == NULL)
+		return (-1);
+	if (exact)
+		node = radix_search_exact(PICKRT(prefix, self), prefix);
+	else {
+		if (prefix->family == AF_INET6)
+			radix_refresh_compiled(self, 1);
+		node = radix_search_best(PICKRT(prefix, self), prefix);
+	}
+	*nodep = (node != NULL && NODE_IN_USE(self, node)) ? node : NULL;
+	return (0);
+}
+
+/* tree[network]: the value of the longest prefix containing network */
+static PyObject *
+Radix_subscript(RadixObject *self, PyObject *key)
+{
+	radix_node_t *node;
+
+	if (mapping_search(self, key, 0, &node) == -1)
+		return NULL;
+	if (node == NULL) {
+		PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+	return (node_result(self, node));
+}
+
+/* tree[network] = value and del tree[network], both for that exact prefix */
+static int
+Radix_ass_subscript(RadixObject *self, PyObject *key, PyObject *value)
+{
+	prefix_t *prefix, prefix_buf;
+	void *data;
+
+	if ((prefix = mapping_key(self, key, &prefix_buf)) == NULL)
+		return (-1);
+	if (value == NULL) {
+		if (radix_delete_prefix(self, prefix) == -1) {
+			if (PyErr_ExceptionMatches(PyExc_KeyError))
+				PyErr_SetObject(PyExc_KeyError, key);
+			return (-1);
+		}
+		return (0);
+	}
+	if (object_to_data(self, value, &data) == -1)
+		return (-1);
+	return (mapping_set(self, prefix, data, NULL));
+}
+
+/*
+ * network in tree: whether tree[network] would find a value. Without a
+ * mapping, look for a RadixNode, as iterating over the tree would.
+ */
+static int
+Radix_contains(RadixObject *self, PyObject *key)
+{
+	radix_node_t *node;
+
+	if (self->mode == RADIX_MODE_NODES) {
+		RADIX_WALK(self->rt4->head, node) {
+			if (node->data == (void *)key)
+				return (1);
+		} RADIX_WALK_END;
+		RADIX_WALK(self->rt6->head, node) {
+			if (node->data == (void *)key)
+				return (1);
+		} RADIX_WALK_END;
+		return (0);
+	}
+	if (mapping_search(self, key, 0, &node) == -1)
+		return (-1);
+	return (node != NULL);
+}
+
+PyDoc_STRVAR(Radix_get_doc,
+"Radix.get(network[, default][, exact]) -> value\n\
+\n\
+For a mapping, returns tree[network], the value of the longest prefix\n\
+containing 'network', or 'default' (None if not given) if there is\n\
+none. If 'exact' is True, only the prefix 'network' itself matches.");
+
+static PyObject *
+Radix_get(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "network", "default", "exact", NULL };
+	PyObject *key, *dflt = Py_None;
+	radix_node_t *node;
+	int exact = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "O|Oi:get", keywords,
+	    &key, &dflt, &exact))
+		return NULL;
+	if (mapping_search(self, key, exact, &node) == -1)
+		return NULL;
+	if (node != NULL)
+		return (node_result(self, node));
+	Py_INCREF(dflt);
+	return (dflt);
+}
+
+static Py_ssize_t
+Radix_length(RadixObject *self)
+{
+	return (self->rt4->num_prefixes + self->rt6->num_prefixes);
+}
+
+/* Add an integer to a dict; returns -1 on failure */
+static int
+dict_set_int(PyObject *dict, const char *key, long value)
+{
+	PyObject *v;
+	int r;
+
+	if ((v = PyInt_FromLong(value)) == NULL)
+		return (-1);
+	r = PyDict_SetItemString(dict, key, v);
+	Py_DECREF(v);
+	return (r);
+}
+
+/* Returns the counts of prefixes at each depth, up to the deepest */
+static PyObject *
+radix_depth_list(radix_tree_t *rt)
+{
+	u_int depths[RADIX_MAXBITS + 1];
+	PyObject *ret, *v;
+	int i, n;
+
+	radix_depths(rt, depths);
+	for (n = RADIX_MAXBITS + 1; n > 0 && depths[n - 1] == 0; n--)
+		;
+	if ((ret = PyList_New(n)) == NULL)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		if ((v = PyInt_FromLong(depths[i])) == NULL) {
+			Py_DECREF(ret);
+			return NULL;
+		}
+		PyList_SET_ITEM(ret, i, v);
+	}
+	return (ret);
+}
+
+/* Add the counts for one tree to a stats dict, with keys ending "af" */
+static int
+radix_tree_stats(PyObject *dict, radix_tree_t *rt, const char *af,
+    int detail)
+{
+	char key[32];
+	PyObject *depths;
+	int r;
+#ifdef RADIX_STATS
+	radix_stats_t *st = &rt->stats;
+	PyObject *avg;
+#endif
+
+#define STAT(name, value) \
+	(snprintf(key, sizeof(key), "%s%s", (name), af), \
+	    dict_set_int(dict, key, (long)(value)))
+
+	if (STAT("prefixes", rt->num_prefixes) == -1 ||
+	    STAT("nodes", rt->num_active_node) == -1 ||
+	    STAT("glue", rt->num_active_node - rt->num_prefixes) == -1 ||
+	    STAT("memory", radix_memory(rt)) == -1)
+		return (-1);
+#ifdef RADIX_STATS
+	if (STAT("lookups", st->lookups) == -1 ||
+	    STAT("removes", st->removes) == -1 ||
+	    STAT("exact_searches", st->exact_searches) == -1 ||
+	    STAT("best_searches", st->best_searches) == -1 ||
+	    STAT("walks", st->walks) == -1 ||
+	    STAT("max_walk_steps", st->max_walk_steps) == -1)
+		return (-1);
+	if ((avg = PyFloat_FromDouble(st->walks == 0 ? 0.0 :
+	    (double)st->walk_steps / st->walks)) == NULL)
+		return (-1);
+	snprintf(key, sizeof(key), "avg_walk_steps%s", af);
+	r = PyDict_SetItemString(dict, key, avg);
+	Py_DECREF(avg);
+	if (r == -1)
+		return (-1);
+#endif
+#undef STAT
+
+	if (!detail)
+		return (0);
+	if ((depths = radix_depth_list(rt)) == NULL)
+		return (-1);
+	snprintf(key, sizeof(key), "depths%s", af);
+	r = PyDict_SetItemString(dict, key, depths);
+	Py_DECREF(depths);
+	return (r);
+}
+
+PyDoc_STRVAR(Radix_stats_doc,
+"Radix.stats([detail]) -> dict\n\
+\n\
+Returns a dict describing the tree. Each key ends in 4 or 6 for the\n\
+IPv4 or IPv6 tree: 'prefixes' is the number of prefixes, 'nodes' the\n\
+number of tree nodes, 'glue' the nodes among them that only join others\n\
+and hold no prefix, and 'memory' the bytes allocated for the nodes and\n\
+any compiled table. These are kept as the tree changes, so are cheap.\n\
+len(tree) is the total number of prefixes.\n\
+\n\
+If 'detail' is True, 'depths' is also given: a list of the number of\n\
+prefixes with each number of nodes above them. This walks the tree.\n\
+\n\
+If the module was built with RADIX_STATS set, the dict also holds\n\
+counts of calls: 'lookups' (adds), 'removes', 'exact_searches' and\n\
+'best_searches', and of 'walks', the best searches that walked the tree\n\
+rather than a compiled table, with their 'avg_walk_steps' and\n\
+'max_walk_steps' in nodes visited.");
+
+static PyObject *
+Radix_stats(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	PyObject *ret;
+	static char *keywords[] = { "detail", NULL };
+	int detail = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|i:stats", keywords,
+	    &detail))
+		return NULL;
+	if ((ret = PyDict_New()) == NULL)
+		return NULL;
+	if (radix_tree_stats(ret, self->rt4, "4", detail) == -1 ||
+	    radix_tree_stats(ret, self->rt6, "6", detail) == -1) {
+		Py_DECREF(ret);
+		return NULL;
+	}
+	return (ret);
+}
+
+/* What the copies of a tree's nodes get as their data */
+struct clone_ctx {
+	int mode;		/* The tree's RADIX_MODE_* */
+	PyObject *deepcopy;	/* copy.deepcopy, for deep copies */
+	PyObject *memo;		/* ...and its memo dict */
+};
+
+/* Copy a payload, or share it in a shallow copy */
+static PyObject *
+clone_payload(struct clone_ctx *ctx, PyObject *obj)
+{
+	if (ctx->deepcopy == NULL) {
+		Py_INCREF(obj);
+		return (obj);
+	}
+	return (PyObject_CallFunctionObjArgs(ctx->deepcopy, obj, ctx->memo,
+	    NULL));
+}
+
+/* radix_clone callback: give the copy of a node its RadixNode or value */
+static int
+clone_data(radix_node_t *node, radix_node_t *copy, void *cbctx)
+{
+	struct clone_ctx *ctx = cbctx;
+	RadixNodeObject *node_obj = node->data, *new_obj;
+
+	if (ctx->mode == RADIX_MODE_MAP) {
+		if ((copy->data = clone_payload(ctx, node->data)) == NULL)
+			return (-1);
+		return (0);
+	}
+	if ((new_obj = newRadixNodeObject(copy)) == NULL)
+		return (-1);
+	copy->data = new_obj;
+	new_obj->tag = node_obj->tag;
+	if (node_obj->user_attr == NULL)
+		return (0);
+	/* A shallow copy still gets a dict of its own */
+	new_obj->user_attr = (ctx->deepcopy == NULL) ?
+	    PyDict_Copy(node_obj->user_attr) :
+	    clone_payload(ctx, node_obj->user_attr);
+	return (new_obj->user_attr == NULL ? -1 : 0);
+}
+
+/*
+ * Copy a tree node by node. The copy's values, or the contents of its
+ * RadixNodes' data dicts, are the same objects, or if memo is given,
+ * copies made with copy.deepcopy.
+ */
 static PyObject *
-radix_getstate(RadixObject *self)
+radix_copy(RadixObject *self, PyObject *memo)
 {
-	radix_node_t *node;
-	PyObject *ret;
-	RadixNodeObject *rnode;
-	PyObject *item_tuple;
-#if PY_MAJOR_VERSION >= 3
-	PyObject *prefix_bytes;
-#endif
+	struct clone_ctx ctx;
+	RadixObject *copy;
+	radix_tree_t *rt4, *rt6;
+	PyObject *mod;
+	rdx_clone_cb_t func;
+	int r;
 
-	if ((ret = PyList_New(0)) == NULL)
+	ctx.mode = self->mode;
+	ctx.deepcopy = NULL;
+	ctx.memo = memo;
+	if (memo != NULL && self->mode != RADIX_MODE_INT) {
+		if ((mod = PyImport_ImportModule("copy")) == NULL)
+			return NULL;
+		ctx.deepcopy = PyObject_GetAttrString(mod, "deepcopy");
+		Py_DECREF(mod);
+		if (ctx.deepcopy == NULL)
+			return NULL;
+	}
+	if ((copy = newRadixObject()) == NULL) {
+		Py_XDECREF(ctx.deepcopy);
+		return NULL;
+	}
+	copy->mode = self->mode;
+	/* An IntRadix's integers are copied along with the nodes */
+	func = (self->mode == RADIX_MODE_INT) ? NULL : clone_data;
+	/* Copying the data runs Python code, and other threads with it */
+	radix_pin(self, &rt4, &rt6);
+	r = radix_clone(rt4, copy->rt4, func, &ctx);
+	if (r == 0)
+		r = radix_clone(rt6, copy->rt6, func, &ctx);
+	/* Stay compiled; without the memory, the copy still works */
+	if (r == 0 && rt4->dir24 != NULL)
+		radix_dir24_compile(copy->rt4);
+	if (r == 0 && rt6->poptrie != NULL)
+		radix_poptrie_compile(copy->rt6);
+	radix_tree_release(rt4, RELEASE_CB(self));
+	radix_tree_release(rt6, RELEASE_CB(self));
+	Py_XDECREF(ctx.deepcopy);
+	if (r == -1) {
+		if (!PyErr_Occurred())
+			PyErr_NoMemory();
+		Py_DECREF(copy);
 		return NULL;
+	}
+	return (PyObject *)copy;
+}
 
-	RADIX_WALK(self->rt4->head, node) {
-		if (node->data != NULL) {
-			rnode = (RadixNodeObject *)node->data;
-#if PY_MAJOR_VERSION >= 3
-			prefix_bytes = PyUnicode_AsASCIIString(rnode->prefix);
-			item_tuple = Py_BuildValue("(OO)", prefix_bytes, rnode->user_attr);
-			PyList_Append(ret, item_tuple);
-			Py_DECREF(item_tuple);
-			Py_DECREF(prefix_bytes);
-#else
-			item_tuple = Py_BuildValue("(OO)", rnode->prefix, rnode->user_attr);
-			PyList_Append(ret, item_tuple);
-			Py_DECREF(item_tuple);
-#endif
-		}
-	} RADIX_WALK_END;
-	RADIX_WALK(self->rt6->head, node) {
-		if (node->data != NULL) {
-			rnode = (RadixNodeObject *)node->data;
-#if PY_MAJOR_VERSION >= 3
-			prefix_bytes = PyUnicode_AsASCIIString(rnode->prefix);
-			item_tuple = Py_BuildValue("(OO)", prefix_bytes, rnode->user_attr);
-			PyList_Append(ret, item_tuple);
-			Py_DECREF(item_tuple);
-			Py_DECREF(prefix_bytes);
-#else
-			item_tuple = Py_BuildValue("(OO)", rnode->prefix, rnode->user_attr);
-			PyList_Append(ret, item_tuple);
-			Py_DECREF(item_tuple);
-#endif
-		}
-	} RADIX_WALK_END;
+PyDoc_STRVAR(Radix_copy_doc,
+"Radix.copy([deep]) -> new Radix tree object\n\
+\n\
+Returns a copy of the tree, made node by node rather than by adding\n\
+each prefix again. The copy has RadixNodes of its own, with the same\n\
+tags, and data dicts holding the same objects; a mapping's copy holds\n\
+the same values. If 'deep' is True, those objects are copied with\n\
+copy.deepcopy instead. copy.copy() and copy.deepcopy() also work.");
+
+static PyObject *
+Radix_copy(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "deep", NULL };
+	PyObject *memo, *ret;
+	int deep = 0;
 
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|i:copy", keywords,
+	    &deep))
+		return NULL;
+	if (!deep)
+		return (radix_copy(self, NULL));
+	if ((memo = PyDict_New()) == NULL)
+		return NULL;
+	ret = radix_copy(self, memo);
+	Py_DECREF(memo);
 	return (ret);
 }
 
 static PyObject *
-Radix_getstate(RadixObject *self, PyObject *args)
+Radix_copy_copy(RadixObject *self, PyObject *args)
 {
-	if (!PyArg_ParseTuple(args, ":__getstate__"))
+	if (!PyArg_ParseTuple(args, ":__copy__"))
 		return NULL;
-	return radix_getstate(self);
+	return (radix_copy(self, NULL));
 }
 
 static PyObject *
-Radix_reduce(RadixObject *self, PyObject *args)
+Radix_deepcopy(RadixObject *self, PyObject *args)
 {
-	PyObject *state, *ret;
+	PyObject *memo;
 
-	if (!PyArg_ParseTuple(args, ":__reduce__"))
+	if (!PyArg_ParseTuple(args, "O!:__deepcopy__", &PyDict_Type, &memo))
 		return NULL;
-	if ((state = radix_getstate(self)) == NULL)
-		return NULL;
-
-	ret = Py_BuildValue("(O()O)", radix_constructor, state);
-	Py_XDECREF(state);
-
-	return ret;
+	return (radix_copy(self, memo));
 }
 
-/* Used for unpickling */
+PyDoc_STRVAR(Radix_snapshot_doc,
+"Radix.snapshot() -> read-only Radix tree object\n\
+\n\
+Returns a read-only view of the tree as it is now, in constant time.\n\
+It may be searched and iterated over, from other threads too, while\n\
+the tree goes on changing; it holds the same RadixNodes or values.\n\
+\n\
+The view shares the tree's nodes. The first change to the tree's IPv4\n\
+or IPv6 prefixes afterwards copies them as copy() would, and leaves\n\
+the view the originals, which are freed once the last view of them\n\
+is dropped. Changes made between snapshots cost no more than usual.");
+
 static PyObject *
-Radix_setstate(RadixObject *self, PyObject *args)
+Radix_snapshot(RadixObject *self, PyObject *args)
 {
-	PyObject *state, *tpl, *addr, *data;
-	int len, i;
-	RadixNodeObject *node;
-	prefix_t *prefix;
-	char *addr_string;
-	const char *errmsg;
+	RadixObject *snap;
+	radix_tree_t *rt4, *rt6;
 
-	if (!Radix_CheckExact(self)) {
-		PyErr_SetString(PyExc_ValueError, "not a Radix object");
+	if (!PyArg_ParseTuple(args, ":snapshot"))
 		return NULL;
+	if (self->readonly) {
+		Py_INCREF(self);
+		return (PyObject *)self;
 	}
-
-	/* XXX type-checking is overstrict here */
-	if (!PyArg_ParseTuple(args, "O!:__setstate__", &PyList_Type, &state))
+	radix_pin(self, &rt4, &rt6);
+	if ((snap = newRadixObjectTrees(rt4, rt6)) == NULL) {
+		radix_tree_release(rt4, RELEASE_CB(self));
+		radix_tree_release(rt6, RELEASE_CB(self));
 		return NULL;
-
-	len = PyList_Size(state);
-	for (i = 0; i < len; i++) {
-		if ((tpl = PyList_GetItem(state, i)) == NULL)
-			return NULL;
-		if ((addr = PyTuple_GetItem(tpl, 0)) == NULL)
-			return NULL;
-		if ((data = PyTuple_GetItem(tpl, 1)) == NULL)
-			return NULL;
-		if ((addr_string = PyString_AsString(addr)) == NULL)
-			return NULL;
-		if ((prefix = prefix_pton(addr_string, -1, &errmsg)) == NULL) {
-			PyErr_SetString(PyExc_ValueError, errmsg ? errmsg :
-			    "Invalid address format");
-			return NULL;
-		}
-		if ((node = (RadixNodeObject *)create_add_node(self,
-		    prefix)) == NULL) {
-			Deref_Prefix(prefix);
-			return NULL;
-		}
-		Deref_Prefix(prefix);
-		Py_XDECREF(node->user_attr);
-		node->user_attr = data;
-		Py_INCREF(node->user_attr);
 	}
-
-	Py_INCREF(Py_None);
-	return Py_None;
+	snap->mode = self->mode;
+	snap->readonly = 1;
+	return (PyObject *)snap;
 }
 
 static PyObject *
 Radix_getiter(RadixObject *self)
 {
-	return (PyObject *)newRadixIterObject(self);
+	/* A mapping iterates over its keys, as a dict does */
+	return (PyObject *)newRadixIterObject(self, 0, NULL,
+	    self->mode != RADIX_MODE_NODES);
 }
 
 PyDoc_STRVAR(Radix_doc, "Radix tree");
 
 static PyMethodDef Radix_methods[] = {
 	{"add",		(PyCFunction)Radix_add,		METH_VARARGS|METH_KEYWORDS,	Radix_add_doc		},
+	{"add_many",	(PyCFunction)Radix_add_many,	METH_VARARGS|METH_KEYWORDS,	Radix_add_many_doc	},
+	{"update",	(PyCFunction)Radix_update,	METH_VARARGS|METH_KEYWORDS,	Radix_update_doc	},
 	{"delete",	(PyCFunction)Radix_delete,	METH_VARARGS|METH_KEYWORDS,	Radix_delete_doc	},
 	{"search_exact",(PyCFunction)Radix_search_exact,METH_VARARGS|METH_KEYWORDS,	Radix_search_exact_doc	},
 	{"search_best",	(PyCFunction)Radix_search_best,	METH_VARARGS|METH_KEYWORDS,	Radix_search_best_doc	},
+	{"search_best_many",(PyCFunction)Radix_search_best_many,METH_VARARGS|METH_KEYWORDS,Radix_search_best_many_doc},
+	{"search_best_into",(PyCFunction)Radix_search_best_into,METH_VARARGS|METH_KEYWORDS,Radix_search_best_into_doc},
+	{"search_covered",(PyCFunction)Radix_search_covered,METH_VARARGS|METH_KEYWORDS,Radix_search_covered_doc},
+	{"search_covering",(PyCFunction)Radix_search_covering,METH_VARARGS|METH_KEYWORDS,Radix_search_covering_doc},
 	{"nodes",	(PyCFunction)Radix_nodes,	METH_VARARGS,			Radix_nodes_doc		},
 	{"prefixes",	(PyCFunction)Radix_prefixes,	METH_VARARGS,			Radix_prefixes_doc	},
+	{"iter_nodes",	(PyCFunction)Radix_iter_nodes,	METH_VARARGS|METH_KEYWORDS,	Radix_iter_nodes_doc	},
+	{"iter_prefixes",(PyCFunction)Radix_iter_prefixes,METH_VARARGS|METH_KEYWORDS,	Radix_iter_prefixes_doc	},
+	{"freeze",	(PyCFunction)Radix_freeze,	METH_VARARGS,			Radix_freeze_doc	},
+	{"compile",	(PyCFunction)Radix_compile,	METH_VARARGS,			Radix_compile_doc	},
+	{"stats",	(PyCFunction)Radix_stats,	METH_VARARGS|METH_KEYWORDS,	Radix_stats_doc		},
+	{"get",		(PyCFunction)Radix_get,		METH_VARARGS|METH_KEYWORDS,	Radix_get_doc		},
+	{"copy",	(PyCFunction)Radix_copy,	METH_VARARGS|METH_KEYWORDS,	Radix_copy_doc		},
+	{"snapshot",	(PyCFunction)Radix_snapshot,	METH_VARARGS,			Radix_snapshot_doc	},
+	{"__copy__",	(PyCFunction)Radix_copy_copy,	METH_VARARGS,			NULL			},
+	{"__deepcopy__",(PyCFunction)Radix_deepcopy,	METH_VARARGS,			NULL			},
 	{"__getstate__",(PyCFunction)Radix_getstate,	METH_VARARGS,			NULL			},
 	{"__setstate__",(PyCFunction)Radix_setstate,	METH_VARARGS,			NULL			},
 	{"__reduce__",	(PyCFunction)Radix_reduce,	METH_VARARGS,			NULL			},
 	{NULL,		NULL}		/* sentinel */
 };
 
+static PyMappingMethods Radix_as_mapping = {
+	(lenfunc)Radix_length,	/*mp_length*/
+	(binaryfunc)Radix_subscript, /*mp_subscript*/
+	(objobjargproc)Radix_ass_subscript, /*mp_ass_subscript*/
+};
+
+static PySequenceMethods Radix_as_sequence = {
+	0,			/*sq_length*/
+	0,			/*sq_concat*/
+	0,			/*sq_repeat*/
+	0,			/*sq_item*/
+	0,			/*sq_slice*/
+	0,			/*sq_ass_item*/
+	0,			/*sq_ass_slice*/
+	(objobjproc)Radix_contains, /*sq_contains*/
+};
+
 static PyTypeObject Radix_Type = {
 	/* The ob_type field must be initialized in the module init function
 	 * to be portable to Windows without using C++. */
@@ -696,8 +3084,8 @@ static PyTypeObject Radix_Type = {
 	0,			/*tp_compare*/
 	0,			/*tp_repr*/
 	0,			/*tp_as_number*/
-	0,			/*tp_as_sequence*/
-	0,			/*tp_as_mapping*/
+	&Radix_as_sequence,	/*tp_as_sequence*/
+	&Radix_as_mapping,	/*tp_as_mapping*/
 	0,			/*tp_hash*/
 	0,			/*tp_call*/
 	0,			/*tp_str*/
@@ -738,13 +3126,21 @@ typedef struct _RadixIterObject {
 	radix_node_t **sp;
 	radix_node_t *rn;
 	int af;
+	int last_af;		/* Family of the last tree to walk */
+	int prefixes;		/* Return prefix strings, not RadixNodes */
 	unsigned int gen_id;	/* Detect tree modifications */
 } RadixIterObject;
 
 static PyTypeObject RadixIter_Type;
 
+/*
+ * Iterate over both trees if family is 0, otherwise over the tree under
+ * "top" in the tree for that family. Returns prefix strings rather than
+ * RadixNodes if "prefixes" is set.
+ */
 static RadixIterObject *
-newRadixIterObject(RadixObject *parent)
+newRadixIterObject(RadixObject *parent, int family, radix_node_t *top,
+    int prefixes)
 {
 	RadixIterObject *self;
 
@@ -756,9 +3152,16 @@ newRadixIterObject(RadixObject *parent)
 	Py_XINCREF(self->parent);
 
 	self->sp = self->iterstack;
-	self->rn = self->parent->rt4->head;
 	self->gen_id = self->parent->gen_id;
-	self->af = AF_INET;
+	if (family == 0) {
+		self->rn = self->parent->rt4->head;
+		self->af = AF_INET;
+		self->last_af = AF_INET6;
+	} else {
+		self->rn = top;
+		self->af = self->last_af = family;
+	}
+	self->prefixes = prefixes;
 	return self;
 }
 
@@ -785,8 +3188,8 @@ RadixIter_iternext(RadixIterObject *self)
 
  again:
 	if ((node = self->rn) == NULL) {
-		/* We have walked both trees */
-		if (self->af == AF_INET6)
+		/* We have walked the last tree */
+		if (self->af == self->last_af)
 			return NULL;
 		/* Otherwise reset and start walk of IPv6 tree */
 		self->sp = self->iterstack;
@@ -807,9 +3210,11 @@ RadixIter_iternext(RadixIterObject *self)
 	else
 		self->rn = NULL;
 
-	if (node->prefix == NULL || node->data == NULL)
+	if (!RADIX_HAS_PREFIX(node) || !NODE_IN_USE(self->parent, node))
 		goto again;
 
+	if (self->prefixes)
+		return (node_prefix_string(node));
 	ret = node->data;
 	Py_INCREF(ret);
 	return (ret);
@@ -847,7 +3252,7 @@ static PyTypeObject RadixIter_Type = {
 	0,			/*tp_clear*/
 	0,			/*tp_richcompare*/
 	0,			/*tp_weaklistoffset*/
-	0,			/*tp_iter*/
+	PyObject_SelfIter,	/*tp_iter*/
 	(iternextfunc)RadixIter_iternext, /*tp_iternext*/
 	0,			/*tp_methods*/
 	0,			/*tp_members*/
@@ -866,28 +3271,376 @@ static PyTypeObject RadixIter_Type = {
 
 /* ------------------------------------------------------------------------ */
 
+/* FrozenRadix: read-only radix tree served from a frozen buffer */
+
+typedef struct {
+	PyObject_HEAD
+	Py_buffer view;		/* Keeps the buffer, e.g. an mmap, alive */
+	void *copy;		/* Private copy of a misaligned buffer */
+	radix_frozen_t ft4;
+	radix_frozen_t ft6;
+} FrozenRadixObject;
+
+static PyTypeObject FrozenRadix_Type;
+
+static void
+FrozenRadix_dealloc(FrozenRadixObject *self)
+{
+	if (self->copy != NULL)
+		PyMem_Free(self->copy);
+	else
+		PyBuffer_Release(&self->view);
+	PyObject_Del(self);
+}
+
+#define PICKFT(prefix, fro) \
+	(prefix->family == AF_INET6 ? &fro->ft6 : &fro->ft4)
+
+static PyObject *
+frozen_search(FrozenRadixObject *self, PyObject *args, PyObject *kw_args,
+    const char *fmt, int best)
+{
+	radix_frozen_t *ft;
+	radix_frozen_node_t *fn;
+	RadixNodeObject *node_obj;
+	prefix_t *prefix, prefix_buf, fn_prefix;
+	static char *keywords[] = { "network", "masklen", "packed", NULL };
+
+	char *addr = NULL, *packed = NULL;
+	long prefixlen = -1;
+	Py_ssize_t packlen = -1;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, fmt, keywords,
+	    &addr, &prefixlen, &packed, &packlen))
+		return NULL;
+	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen,
+	    &prefix_buf)) == NULL)
+		return NULL;
+
+	ft = PICKFT(prefix, self);
+	if (best)
+		fn = radix_frozen_search_best(ft, prefix);
+	else
+		fn = radix_frozen_search_exact(ft, prefix);
+	if (fn == NULL) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	radix_frozen_node_prefix(ft, fn, &fn_prefix);
+	if ((node_obj = newRadixNodeObjectPrefix(&fn_prefix)) == NULL)
+		return NULL;
+	node_obj->tag = (long)fn->value;
+	return (PyObject *)node_obj;
+}
+
+PyDoc_STRVAR(FrozenRadix_search_exact_doc,
+"FrozenRadix.search_exact(network[, masklen][, packed] -> RadixNode or None\n\
+\n\
+As Radix.search_exact. The RadixNode returned is a new object, whose\n\
+tag is that of the node when the tree was frozen.");
+
+static PyObject *
+FrozenRadix_search_exact(FrozenRadixObject *self, PyObject *args,
+    PyObject *kw_args)
+{
+	return frozen_search(self, args, kw_args, "|sls#:search_exact", 0);
+}
+
+PyDoc_STRVAR(FrozenRadix_search_best_doc,
+"FrozenRadix.search_best(network[, masklen][, packed] -> RadixNode or None\n\
+\n\
+As Radix.search_best. The RadixNode returned is a new object, whose\n\
+tag is that of the node when the tree was frozen.");
+
+static PyObject *
+FrozenRadix_search_best(FrozenRadixObject *self, PyObject *args,
+    PyObject *kw_args)
+{
+	return frozen_search(self, args, kw_args, "|sls#:search_best", 1);
+}
+
+PyDoc_STRVAR(FrozenRadix_prefixes_doc,
+"FrozenRadix.prefixes() -> List of prefix strings\n\
+\n\
+Returns a list containing all the prefixes in the tree.");
+
+static PyObject *
+FrozenRadix_prefixes(FrozenRadixObject *self, PyObject *args)
+{
+	radix_frozen_t *fts[2];
+	radix_frozen_node_t *fn;
+	PyObject *ret, *prefix_str;
+	prefix_t prefix;
+	u_int32_t i;
+	int j;
+
+	if (!PyArg_ParseTuple(args, ":prefixes"))
+		return NULL;
+
+	if ((ret = PyList_New(0)) == NULL)
+		return NULL;
+
+	fts[0] = &self->ft4;
+	fts[1] = &self->ft6;
+	for (j = 0; j < 2; j++) {
+		for (i = 0; i < fts[j]->num_nodes; i++) {
+			fn = &fts[j]->nodes[i];
+			if (radix_frozen_node_prefix(fts[j], fn,
+			    &prefix) == NULL)
+				continue;
+			if ((prefix_str = prefix_to_string(&prefix)) == NULL ||
+			    PyList_Append(ret, prefix_str) == -1) {
+				Py_XDECREF(prefix_str);
+				Py_DECREF(ret);
+				return NULL;
+			}
+			Py_DECREF(prefix_str);
+		}
+	}
+	return (ret);
+}
+
+static PyMethodDef FrozenRadix_methods[] = {
+	{"search_exact",(PyCFunction)FrozenRadix_search_exact,METH_VARARGS|METH_KEYWORDS,FrozenRadix_search_exact_doc},
+	{"search_best",	(PyCFunction)FrozenRadix_search_best,METH_VARARGS|METH_KEYWORDS,FrozenRadix_search_best_doc},
+	{"prefixes",	(PyCFunction)FrozenRadix_prefixes,METH_VARARGS,		FrozenRadix_prefixes_doc},
+	{NULL,		NULL}		/* sentinel */
+};
+
+PyDoc_STRVAR(FrozenRadix_doc, "Read-only radix tree");
+
+static PyTypeObject FrozenRadix_Type = {
+	/* The ob_type field must be initialized in the module init function
+	 * to be portable to Windows without using C++. */
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"radix.FrozenRadix",	/*tp_name*/
+	sizeof(FrozenRadixObject),/*tp_basicsize*/
+	0,			/*tp_itemsize*/
+	/* methods */
+	(destructor)FrozenRadix_dealloc, /*tp_dealloc*/
+	0,			/*tp_print*/
+	0,			/*tp_getattr*/
+	0,			/*tp_setattr*/
+	0,			/*tp_compare*/
+	0,			/*tp_repr*/
+	0,			/*tp_as_number*/
+	0,			/*tp_as_sequence*/
+	0,			/*tp_as_mapping*/
+	0,			/*tp_hash*/
+	0,			/*tp_call*/
+	0,			/*tp_str*/
+	0,			/*tp_getattro*/
+	0,			/*tp_setattro*/
+	0,			/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+	FrozenRadix_doc,	/*tp_doc*/
+	0,			/*tp_traverse*/
+	0,			/*tp_clear*/
+	0,			/*tp_richcompare*/
+	0,			/*tp_weaklistoffset*/
+	0,			/*tp_iter*/
+	0,			/*tp_iternext*/
+	FrozenRadix_methods,	/*tp_methods*/
+	0,			/*tp_members*/
+	0,			/*tp_getset*/
+	0,			/*tp_base*/
+	0,			/*tp_dict*/
+	0,			/*tp_descr_get*/
+	0,			/*tp_descr_set*/
+	0,			/*tp_dictoffset*/
+	0,			/*tp_init*/
+	0,			/*tp_alloc*/
+	0,			/*tp_new*/
+	0,			/*tp_free*/
+	0,			/*tp_is_gc*/
+};
+
+/* ------------------------------------------------------------------------ */
+
 /* Radix object creator */
 
 PyDoc_STRVAR(radix_Radix_doc,
-"Radix() -> new Radix tree object\n\
+"Radix([mapping]) -> new Radix tree object\n\
+\n\
+Instantiate a new radix tree object.\n\
 \n\
-Instantiate a new radix tree object.");
+If 'mapping' is True, the tree maps prefixes straight to values, like\n\
+a dict, and has no RadixNodes: 'tree[network] = value' stores a value\n\
+for the prefix 'network', and 'del tree[network]' removes it. Reading\n\
+'tree[network]' returns the value of the longest prefix containing\n\
+'network', as search_best would find it, and 'network in tree' tells\n\
+whether there is one; Radix.get does either kind of search. Iterating\n\
+over the tree gives the prefixes. The methods returning RadixNodes, and\n\
+add, are not supported; search_best_many returns values and add_many\n\
+takes them.");
 
 static PyObject *
-radix_Radix(PyObject *self, PyObject *args)
+radix_Radix(PyObject *self, PyObject *args, PyObject *kw_args)
 {
 	RadixObject *rv;
+	static char *keywords[] = { "mapping", NULL };
+	int mapping = 0;
 
-	if (!PyArg_ParseTuple(args, ":Radix"))
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|i:Radix", keywords,
+	    &mapping))
 		return NULL;
 	rv = newRadixObject();
 	if (rv == NULL)
 		return NULL;
+	if (mapping)
+		rv->mode = RADIX_MODE_MAP;
+	return (PyObject *)rv;
+}
+
+PyDoc_STRVAR(radix_IntRadix_doc,
+"IntRadix() -> new Radix tree object mapping prefixes to integers\n\
+\n\
+Instantiate a radix tree that maps prefixes to unsigned integers, of\n\
+up to 64 bits (32 on 32-bit platforms), like Radix(mapping=True) but\n\
+keeping each integer in the tree node itself: a prefix costs no Python\n\
+objects at all. Lookups return plain ints. search_best_into() can\n\
+write the values of the matches with result='value', and freeze()\n\
+makes them the tags of the frozen nodes.");
+
+static PyObject *
+radix_IntRadix(PyObject *self, PyObject *args)
+{
+	RadixObject *rv;
+
+	if (!PyArg_ParseTuple(args, ":IntRadix"))
+		return NULL;
+	if ((rv = newRadixObject()) == NULL)
+		return NULL;
+	rv->mode = RADIX_MODE_INT;
+	return (PyObject *)rv;
+}
+
+PyDoc_STRVAR(radix_from_prefixes_doc,
+"from_prefixes(networks) -> new Radix tree object\n\
+\n\
+Instantiate a new radix tree object holding the networks, or\n\
+(network, data) pairs, yielded by the iterable 'networks'. See\n\
+Radix.add_many.");
+
+static PyObject *
+radix_from_prefixes(PyObject *self, PyObject *args)
+{
+	RadixObject *rv;
+	PyObject *networks;
+
+	if (!PyArg_ParseTuple(args, "O:from_prefixes", &networks))
+		return NULL;
+	if ((rv = newRadixObject()) == NULL)
+		return NULL;
+	if (add_many_iter(rv, networks) == -1) {
+		Py_DECREF(rv);
+		return NULL;
+	}
+	return (PyObject *)rv;
+}
+
+PyDoc_STRVAR(radix_FrozenRadix_doc,
+"FrozenRadix(buffer) -> new FrozenRadix object\n\
+\n\
+Opens a tree frozen by Radix.freeze, which is searched in place. The\n\
+buffer is typically a read-only mmap of a file, so that processes\n\
+mapping the same file share a single copy of the tree:\n\
+\n\
+	f = open(path, 'rb')\n\
+	m = mmap.mmap(f.fileno(), 0, access = mmap.ACCESS_READ)\n\
+	tree = radix.FrozenRadix(m)\n\
+\n\
+The buffer remains in use for the life of the FrozenRadix. One that\n\
+isn't 8-byte aligned, such as a bytes object on some platforms, is\n\
+copied instead.");
+
+static PyObject *
+radix_FrozenRadix(PyObject *self, PyObject *args)
+{
+	FrozenRadixObject *rv;
+	struct frozen_hdr hdr;
+	radix_frozen_node_t *nodes;
+	PyObject *buffer;
+	Py_buffer view;
+	u_char *buf;
+	size_t nnodes;
+
+	if (!PyArg_ParseTuple(args, "O:FrozenRadix", &buffer))
+		return NULL;
+#if PY_MAJOR_VERSION < 3
+	/*
+	 * Python 2's mmap only has the old buffer interface, which doesn't
+	 * stop the mapping being closed underneath us. Don't do that.
+	 */
+	if (!PyObject_CheckBuffer(buffer)) {
+		const void *buf;
+		Py_ssize_t len;
+
+		if (PyObject_AsReadBuffer(buffer, &buf, &len) == -1 ||
+		    PyBuffer_FillInfo(&view, buffer, (void *)buf, len, 1,
+		    PyBUF_SIMPLE) == -1)
+			return NULL;
+	} else
+#endif
+	if (PyObject_GetBuffer(buffer, &view, PyBUF_SIMPLE) == -1)
+		return NULL;
+
+	if ((size_t)view.len < sizeof(hdr)) {
+		PyErr_SetString(PyExc_ValueError, "Not a frozen radix tree");
+		goto fail;
+	}
+	memcpy(&hdr, view.buf, sizeof(hdr));
+	if (memcmp(hdr.magic, RADIX_FROZEN_MAGIC, sizeof(hdr.magic)) != 0) {
+		PyErr_SetString(PyExc_ValueError, "Not a frozen radix tree");
+		goto fail;
+	}
+	if (hdr.version != RADIX_FROZEN_VERSION) {
+		PyErr_SetString(PyExc_ValueError, "Unsupported frozen tree "
+		    "version or byte order");
+		goto fail;
+	}
+	nnodes = (size_t)hdr.num_nodes[0] + hdr.num_nodes[1];
+	if (((size_t)view.len - sizeof(hdr)) / sizeof(*nodes) != nnodes ||
+	    ((size_t)view.len - sizeof(hdr)) % sizeof(*nodes) != 0) {
+		PyErr_SetString(PyExc_ValueError,
+		    "Invalid frozen tree length");
+		goto fail;
+	}
+	if ((rv = PyObject_New(FrozenRadixObject, &FrozenRadix_Type)) == NULL)
+		goto fail;
+	rv->view = view;
+	rv->copy = NULL;
+	buf = view.buf;
+	if (((size_t)buf % 8) != 0) {
+		if ((rv->copy = PyMem_Malloc(view.len)) == NULL) {
+			Py_DECREF(rv);
+			return PyErr_NoMemory();
+		}
+		memcpy(rv->copy, buf, view.len);
+		PyBuffer_Release(&view);
+		buf = rv->copy;
+	}
+	nodes = (radix_frozen_node_t *)(buf + sizeof(hdr));
+	if (radix_frozen_init(&rv->ft4, AF_INET, nodes,
+	    hdr.num_nodes[0]) == -1 ||
+	    radix_frozen_init(&rv->ft6, AF_INET6, nodes + hdr.num_nodes[0],
+	    hdr.num_nodes[1]) == -1) {
+		PyErr_SetString(PyExc_ValueError, "Corrupt frozen tree");
+		Py_DECREF(rv);
+		return NULL;
+	}
 	return (PyObject *)rv;
+
+ fail:
+	PyBuffer_Release(&view);
+	return NULL;
 }
 
 static PyMethodDef radix_methods[] = {
-	{"Radix",	radix_Radix,	METH_VARARGS,	radix_Radix_doc	},
+	{"Radix",	(PyCFunction)radix_Radix,METH_VARARGS|METH_KEYWORDS,radix_Radix_doc},
+	{"IntRadix",	radix_IntRadix,	METH_VARARGS,	radix_IntRadix_doc},
+	{"from_prefixes",radix_from_prefixes,METH_VARARGS,radix_from_prefixes_doc},
+	{"FrozenRadix",	radix_FrozenRadix,METH_VARARGS,	radix_FrozenRadix_doc},
 	{NULL,		NULL}		/* sentinel */
 };
 
@@ -964,8 +3717,24 @@ PyDoc_STRVAR(module_doc,
 "	# iterating otherwise you will abort the iteration and\n"
 "	# receive a RuntimeWarning. Changing a node's data dict\n"
 "	# is permitted.\n"
+"	# To go on changing the tree, iterate over a snapshot of\n"
+"	# it instead: for rnode in rtree.snapshot(): ...\n"
 "	for rnode in rtree:\n"
 "  		print rnode.prefix\n"
+"\n"
+"	# A tree made with mapping=True maps prefixes straight to\n"
+"	# values, without RadixNodes, and looks them up by best match\n"
+"	rmap = radix.Radix(mapping=True)\n"
+"	rmap[\"10.0.0.0/8\"] = \"whatever you want\"\n"
+"	print rmap[\"10.123.45.6\"]	# -> \"whatever you want\"\n"
+"	print \"11.0.0.1\" in rmap	# -> False\n"
+"	del rmap[\"10.0.0.0/8\"]\n"
+"\n"
+"	# An IntRadix does the same for integers, such as AS numbers,\n"
+"	# storing them in the tree itself\n"
+"	asns = radix.IntRadix()\n"
+"	asns[\"192.0.2.0/24\"] = 64496\n"
+"	print asns.get(\"192.0.2.1\")	# -> 64496\n"
 );
 
 #if PY_MAJOR_VERSION >= 3
@@ -1022,15 +3791,18 @@ static PyObject *module_initialize(void)
 		return NULL;
 	if (PyType_Ready(&RadixNode_Type) < 0)
 		return NULL;
+	if (PyType_Ready(&FrozenRadix_Type) < 0)
+		return NULL;
 #if PY_MAJOR_VERSION >= 3
 	m = PyModule_Create(&radix_module_def);
 #else
 	m = Py_InitModule3("radix", radix_methods, module_doc);
 #endif
 
-	/* Stash the callable constructor for use in Radix.__reduce__ */
+	/* Stash the callable constructors for use in Radix.__reduce__ */
 	d = PyModule_GetDict(m);
 	radix_constructor = PyDict_GetItemString(d, "Radix");
+	intradix_constructor = PyDict_GetItemString(d, "IntRadix");
 
 	PyModule_AddStringConstant(m, "__version__", "0.4");
 
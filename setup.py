@@ -16,6 +16,7 @@
 
 # $Id$
 
+import os
 import platform
 import sys
 from distutils.core import setup, Extension
@@ -24,13 +25,18 @@ VERSION = "0.5"
 
 if __name__ == '__main__':
 	libs = []
-	src = [ 'radix.c', 'radix_python.c' ]
+	src = [ 'radix.c', 'radix_dir24.c', 'radix_poptrie.c', 'radix_python.c' ]
 	if sys.platform == 'win32':
 		libs += [ 'ws2_32' ]
 		src += [ 'strlcpy.c' ]
 		if platform.version() < '6.0': # not newer than Vista
 			src += [ 'inet_ntop.c' ]
-	radix = Extension('radix', libraries = libs, sources = src)
+	macros = []
+	# Set RADIX_STATS in the environment to count tree operations
+	if os.environ.get('RADIX_STATS'):
+		macros += [ ('RADIX_STATS', None) ]
+	radix = Extension('radix', libraries = libs, sources = src,
+	    define_macros = macros)
 	setup(	name = "radix",
 		version = VERSION,
 		author = "Damien Miller",
@@ -22,6 +22,8 @@ import unittest
 import socket
 import struct
 import pickle
+import mmap
+import tempfile
 if sys.version_info[0] >= 3:
 	# for Py3K
 	t00_class_name = "<class 'radix.Radix'>"
@@ -376,6 +378,768 @@ class TestRadix(unittest.TestCase):
 		self.assertEquals(tree.search_best('10.0.0.0/15').prefix,
 		    '10.0.0.0/13')
 
+	def test_23__search_best_many(self):
+		tree = radix.Radix()
+		node1 = tree.add("10.0.0.0/8")
+		node2 = tree.add("10.0.0.0/16")
+		node3 = tree.add("dead:beef::/32")
+		nodes = tree.search_best_many(["10.0.1.1", "10.1.1.1",
+		    "127.0.0.1", "dead:beef::1", "10.0.0.0/12"])
+		self.assertEqual(nodes, [node2, node1, None, node3, node1])
+		packed = socket.inet_aton("10.0.1.1") + \
+		    socket.inet_aton("127.0.0.1") + socket.inet_aton("10.9.9.9")
+		nodes = tree.search_best_many(packed = packed)
+		self.assertEqual(nodes, [node2, None, node1])
+		nodes = tree.search_best_many(packed = t15_packed_addr,
+		    family = socket.AF_INET6)
+		self.assertEqual(nodes, [node3])
+		self.assertEqual(tree.search_best_many([]), [])
+		self.assertRaises(ValueError, tree.search_best_many, ["blah"])
+		self.assertRaises(ValueError, tree.search_best_many,
+		    packed = packed[:5])
+		self.assertRaises(TypeError, tree.search_best_many)
+
+	def test_24__concurrent_search_best_many(self):
+		import threading
+		tree = radix.Radix()
+		node = tree.add("10.0.0.0/8")
+		packed = socket.inet_aton("10.1.2.3") * 1000
+		errors = []
+		def reader():
+			for i in range(50):
+				nodes = tree.search_best_many(packed = packed)
+				if nodes.count(node) != 1000:
+					errors.append(nodes)
+		threads = [threading.Thread(target = reader) for i in range(4)]
+		for t in threads:
+			t.start()
+		for i in range(500):
+			tree.add("192.168.%d.0/24" % (i % 256))
+			tree.delete("192.168.%d.0/24" % (i % 256))
+		for t in threads:
+			t.join()
+		self.assertEqual(errors, [])
+
+	def test_46__concurrent_delete(self):
+		import threading
+		tree = radix.Radix()
+		tree.add("10.0.0.0/8")
+		packed = socket.inet_aton("10.1.2.3") * 100000
+		stop = []
+		deleted = []
+		def reader():
+			while not stop:
+				tree.search_best_many(packed = packed)
+		def deleter():
+			for i in range(200):
+				try:
+					tree.delete("10.1.0.0/16")
+					deleted.append(i)
+				except KeyError:
+					pass
+		readers = [threading.Thread(target = reader) for i in range(3)]
+		for t in readers:
+			t.start()
+		for i in range(20):
+			tree.add("10.1.0.0/16")
+			deleters = [threading.Thread(target = deleter)
+			    for j in range(2)]
+			for t in deleters:
+				t.start()
+			for t in deleters:
+				t.join()
+		stop.append(True)
+		for t in readers:
+			t.join()
+		self.assertEqual(len(deleted), 20)
+		self.assertEqual(tree.prefixes(), [ "10.0.0.0/8" ])
+
+	def test_44__concurrent_search_best_into(self):
+		import threading, ctypes
+		tree = radix.Radix()
+		tree.add("10.0.0.0/8")
+		# Small batches, to take the read lock as often as possible
+		packed = socket.inet_aton("10.1.2.3") * 64
+		stop = []
+		misses = []
+		def reader():
+			out = (ctypes.c_int32 * 64)()
+			while not stop:
+				found = tree.search_best_into(packed, out)
+				if found != 64:
+					misses.append(found)
+		readers = [threading.Thread(target = reader) for i in range(4)]
+		for t in readers:
+			t.start()
+		for i in range(6000):
+			snap = tree.snapshot()
+			tree.add("11.%d.%d.0/24" % (i // 256, i % 256))
+			del snap
+		stop.append(True)
+		for t in readers:
+			t.join()
+		self.assertEqual(misses, [])
+
+	def test_25__search_best_into(self):
+		import ctypes
+		tree = radix.Radix()
+		node1 = tree.add("10.0.0.0/8")
+		node2 = tree.add("10.0.0.0/16")
+		node3 = tree.add("dead:beef::/32")
+		node1.tag = 65001
+		node2.tag = 65002
+		packed = socket.inet_aton("10.0.1.1") + \
+		    socket.inet_aton("127.0.0.1") + socket.inet_aton("10.9.9.9")
+		out = (ctypes.c_int32 * 3)()
+		self.assertEqual(tree.search_best_into(packed, out), 2)
+		self.assertEqual(list(out), [16, -1, 8])
+		self.assertEqual(tree.search_best_into(packed, out,
+		    result = "tag"), 2)
+		self.assertEqual(list(out), [65002, -1, 65001])
+		# Integer addresses, in the buffer's own byte order
+		ints = (ctypes.c_uint32 * 3)(0x0a000101, 0x7f000001, 0x0a090909)
+		out = (ctypes.c_int64 * 3)()
+		self.assertEqual(tree.search_best_into(ints, out), 2)
+		self.assertEqual(list(out), [16, -1, 8])
+		# Wider or narrower integers aren't read as packed bytes
+		for ctype in [ ctypes.c_uint16, ctypes.c_uint64 ]:
+			self.assertRaises(ValueError, tree.search_best_into,
+			    (ctype * 8)(0x0a01), out)
+		self.assertRaises(ValueError, tree.search_best_into, ints,
+		    out, family = socket.AF_INET6)
+		out = (ctypes.c_int32 * 1)()
+		self.assertEqual(tree.search_best_into(t15_packed_addr, out,
+		    family = socket.AF_INET6), 1)
+		self.assertEqual(list(out), [32])
+		self.assertRaises(ValueError, tree.search_best_into, packed,
+		    (ctypes.c_int32 * 1)())
+		self.assertRaises(TypeError, tree.search_best_into, packed,
+		    bytearray(12))
+		self.assertRaises(ValueError, tree.search_best_into, packed,
+		    out, result = "blah")
+
+	def test_26__address_parsing(self):
+		tree = radix.Radix()
+		for addr in [ "0.0.0.0", "255.255.255.255", "10.1.2.3",
+		    "::", "::1", "1::", "1:2:3:4:5:6:7:8", "1:2:3:4:5:6:7::",
+		    "::2:3:4:5:6:7:8", "2001:DB8::abcd", "::ffff:10.1.2.3",
+		    "1:2:3:4:5:6:10.1.2.3" ]:
+			family = ':' in addr and socket.AF_INET6 or \
+			    socket.AF_INET
+			node = tree.add(addr)
+			self.assertEqual(node.packed,
+			    socket.inet_pton(family, addr))
+		self.assertEqual(tree.add("10.1.2.3/8").prefix, "10.0.0.0/8")
+		self.assertEqual(tree.add("2001:db8::1/32").prefix,
+		    "2001:db8::/32")
+		for addr in [ "", "1.2.3.", "1..2.3", "256.1.1.1",
+		    "1.2.3.4.5", "1:2:3:4:5:6:7:8:9", "1::2::3", ":1", "1:",
+		    "12345::", "1.2.3.4/", "1.2.3.4/x", "1.2.3.4/33",
+		    "::/129", "1:2:3:4:5:6:7:1.2.3.4" ]:
+			self.assertRaises(ValueError, tree.add, addr)
+		self.assertRaises(ValueError, tree.add, "1.2.3.4/8", 8)
+
+	def test_27__node_attributes_after_delete(self):
+		tree = radix.Radix()
+		node = tree.add("dead:beef::/32")
+		tree.delete("dead:beef::/32")
+		self.assertEqual(node.prefix, "dead:beef::/32")
+		self.assert_(node.prefix is node.prefix)
+		self.assertEqual(node.network, "dead:beef::")
+		self.assertEqual(node.prefixlen, 32)
+		self.assertEqual(node.family, socket.AF_INET6)
+		self.assertEqual(node.packed, socket.inet_pton(socket.AF_INET6,
+		    "dead:beef::"))
+		self.assert_(node.data is node.data)
+		self.assertEqual(node.data, {})
+
+	def test_28__pickle_untouched_data(self):
+		tree = radix.Radix()
+		tree.add("10.0.0.0/8")
+		tree.add("10.0.0.0/16").data["x"] = 1
+		tree2 = pickle.loads(pickle.dumps(tree))
+		self.assertEqual(tree2.search_exact("10.0.0.0/8").data, {})
+		self.assertEqual(tree2.search_exact("10.0.0.0/16").data,
+		    {"x": 1})
+		self.assertEqual(sorted(tree2.prefixes()),
+		    ["10.0.0.0/16", "10.0.0.0/8"])
+
+	def test_29__add_many(self):
+		prefixes = [ "10.0.0.0/8", "10.0.0.0/16", "10.0.1.0/24",
+		    "10.1.0.0/16", "172.16.0.0/12", "192.168.0.0/24",
+		    "::/0", "2001:db8::/32", "2001:db8:1::/48" ]
+		tree = radix.Radix()
+		tree.add_many(prefixes)
+		self.assertEqual(sorted(tree.prefixes()), sorted(prefixes))
+		tree = radix.from_prefixes(reversed(prefixes))
+		self.assertEqual(sorted(tree.prefixes()), sorted(prefixes))
+		tree.add_many([ ("10.0.0.0/8", { "a": 1 }), "10.2.0.0/16" ])
+		self.assertEqual(tree.search_exact("10.0.0.0/8").data,
+		    { "a": 1 })
+		self.assertEqual(tree.search_best("10.2.3.4").prefix,
+		    "10.2.0.0/16")
+		packed = b"".join([ socket.inet_aton("10.%d.0.0" % i)
+		    for i in range(8) ])
+		tree.add_many(packed=packed, masklen=24)
+		self.assertEqual(tree.search_best("10.7.0.1").prefix,
+		    "10.7.0.0/24")
+		self.assertEqual(len(tree.prefixes()), len(prefixes) + 9)
+		self.assertRaises(ValueError, tree.add_many, [ "10.0.0.0/33" ])
+		self.assertRaises(TypeError, tree.add_many, [ ("10.0.0.0/8",) ])
+		self.assertRaises(ValueError, tree.add_many, packed=b"abc")
+		self.assertRaises(TypeError, tree.add_many)
+
+	def test_30__pickle_snapshot(self):
+		tree = radix.Radix()
+		for prefix in [ "0.0.0.0/0", "10.0.0.0/8", "10.0.0.0/16",
+		    "10.1.0.0/16", "10.1.2.3/32", "::/0", "2001:db8::/32",
+		    "2001:db8::1/128" ]:
+			tree.add(prefix).data["p"] = prefix
+		tree.add("192.168.0.0/24")
+		tree.delete("10.0.0.0/16")
+		tree2 = pickle.loads(pickle.dumps(tree, 2))
+		self.assertEqual(tree2.prefixes(), tree.prefixes())
+		for node in tree:
+			node2 = tree2.search_exact(node.prefix)
+			self.assertEqual(node2.data, node.data)
+		self.assertEqual(tree2.search_best("10.1.2.4").prefix,
+		    "10.1.0.0/16")
+		self.assertEqual(tree2.search_best("2001:db8::2").prefix,
+		    "2001:db8::/32")
+		tree2.add("10.0.0.0/16")
+		tree2.delete("10.0.0.0/8")
+		self.assertEqual(tree2.search_best("10.0.1.1").prefix,
+		    "10.0.0.0/16")
+
+		# Snapshots merge into a non-empty tree; old state still loads
+		state = tree.__reduce__()[2]
+		tree3 = radix.Radix()
+		tree3.add("172.16.0.0/12")
+		tree3.__setstate__(state)
+		self.assertEqual(len(tree3.prefixes()), len(tree.prefixes()) + 1)
+		tree4 = radix.Radix()
+		tree4.__setstate__(tree.__getstate__())
+		self.assertEqual(tree4.prefixes(), tree.prefixes())
+
+		blob, payload = state
+		self.assertRaises(ValueError, radix.Radix().__setstate__,
+		    (blob[:-1], payload))
+		self.assertRaises(ValueError, radix.Radix().__setstate__,
+		    (blob, payload[:-1]))
+		self.assertRaises(ValueError, radix.Radix().__setstate__,
+		    (blob[:3] + b"\xff" + blob[4:], payload))
+
+		# Packed prefixes may carry host bits, which are dropped
+		tree5 = radix.Radix()
+		tree5.add(packed = socket.inet_aton("10.1.2.3"), masklen = 12)
+		tree5 = pickle.loads(pickle.dumps(tree5))
+		self.assertEqual(tree5.prefixes(), [ "10.0.0.0/12" ])
+
+	def test_31__frozen(self):
+		tree = radix.Radix()
+		for i, prefix in enumerate([ "0.0.0.0/0", "10.0.0.0/8",
+		    "10.0.0.0/16", "10.1.0.0/16", "10.1.2.3/32", "::/0",
+		    "2001:db8::/32", "2001:db8::1/128" ]):
+			tree.add(prefix).tag = i + 1
+		tree.add("192.168.0.0/24")
+		tree.delete("10.0.0.0/16")
+		f = tempfile.TemporaryFile()
+		f.write(tree.freeze())
+		f.flush()
+		m = mmap.mmap(f.fileno(), 0, access = mmap.ACCESS_READ)
+		frozen = radix.FrozenRadix(m)
+		self.assertEqual(frozen.prefixes(), tree.prefixes())
+		for addr in [ "10.1.2.3", "10.1.2.4", "10.0.0.1", "11.0.0.0",
+		    "192.168.0.9", "2001:db8::1", "2001:db8::2", "2001::1" ]:
+			node = tree.search_best(addr)
+			fnode = frozen.search_best(addr)
+			self.assertEqual(fnode.prefix, node.prefix)
+			self.assertEqual(fnode.tag, node.tag)
+		self.assertEqual(frozen.search_exact("10.1.0.0/16").tag, 4)
+		self.assertEqual(frozen.search_exact("192.168.0.0/24").tag, 0)
+		self.assertEqual(frozen.search_exact("10.0.0.0/16"), None)
+		self.assertEqual(frozen.search_exact("10.1.2.0/24"), None)
+		self.assertEqual(frozen.search_best(packed = socket.inet_aton(
+		    "10.9.9.9")).prefix, "10.0.0.0/8")
+		# The mmap can't be closed while it is exported to the tree
+		del frozen, fnode
+		m.close()
+		f.close()
+		self.assertEqual(radix.FrozenRadix(
+		    radix.Radix().freeze()).search_best("1.2.3.4"), None)
+		blob = tree.freeze()
+		self.assertRaises(ValueError, radix.FrozenRadix, blob[:-1])
+		self.assertRaises(ValueError, radix.FrozenRadix, b"x" + blob[1:])
+
+	def test_32__compile(self):
+		tree = radix.Radix()
+		tree.compile()
+		prefixes = [ "0.0.0.0/0", "10.0.0.0/8", "10.1.0.0/16",
+		    "10.1.2.0/24", "10.1.2.128/25", "10.1.2.130/32",
+		    "10.1.3.0/30", "192.168.0.0/23", "2001:db8::/32" ]
+		for prefix in prefixes:
+			tree.add(prefix)
+		expect = {
+			"10.1.2.130": "10.1.2.130/32",
+			"10.1.2.131": "10.1.2.128/25",
+			"10.1.2.1": "10.1.2.0/24",
+			"10.1.3.3": "10.1.3.0/30",
+			"10.1.3.4": "10.1.0.0/16",
+			"192.168.1.1": "192.168.0.0/23",
+			"11.0.0.1": "0.0.0.0/0",
+		}
+		for addr in expect:
+			self.assertEqual(tree.search_best(addr).prefix,
+			    expect[addr])
+		tree.delete("10.1.2.128/25")
+		tree.delete("0.0.0.0/0")
+		self.assertEqual(tree.search_best("10.1.2.131").prefix,
+		    "10.1.2.0/24")
+		self.assertEqual(tree.search_best("10.1.2.130").prefix,
+		    "10.1.2.130/32")
+		self.assertEqual(tree.search_best("11.0.0.1"), None)
+		tree.delete("10.1.2.130/32")
+		tree.delete("10.1.3.0/30")
+		self.assertEqual(tree.search_best("10.1.3.3").prefix,
+		    "10.1.0.0/16")
+		self.assertEqual(tree.search_best("10.1.2.130").prefix,
+		    "10.1.2.0/24")
+		self.assertEqual(tree.search_best_many([ "10.1.2.130",
+		    "172.16.0.1" ])[0].prefix, "10.1.2.0/24")
+		tree2 = pickle.loads(pickle.dumps(tree))
+		self.assertEqual(tree2.search_best("10.1.9.9").prefix,
+		    "10.1.0.0/16")
+		tree.compile(False)
+		self.assertEqual(tree.search_best("10.1.2.130").prefix,
+		    "10.1.2.0/24")
+
+	def test_33__compile6(self):
+		tree = radix.Radix()
+		prefixes = [ "::/0", "2001:db8::/32", "2001:db8:1::/48",
+		    "2001:db8:1:2::/64", "2001:db8:1:2::80/121",
+		    "2001:db8:1:2::82/128", "2001:db8:1:6::/63",
+		    "2001:dba::/31", "::ffff:10.0.0.0/104" ]
+		for prefix in prefixes:
+			tree.add(prefix)
+		tree.compile()
+		expect = {
+			"2001:db8:1:2::82": "2001:db8:1:2::82/128",
+			"2001:db8:1:2::83": "2001:db8:1:2::80/121",
+			"2001:db8:1:2::1": "2001:db8:1:2::/64",
+			"2001:db8:1:7:ffff::1": "2001:db8:1:6::/63",
+			"2001:db8:1:2:1::": "2001:db8:1:2::/64",
+			"2001:db8:1:4::1": "2001:db8:1::/48",
+			"2001:db8:2::1": "2001:db8::/32",
+			"2001:dbb:ffff::1": "2001:dba::/31",
+			"::ffff:10.1.2.3": "::ffff:10.0.0.0/104",
+			"3000::1": "::/0",
+		}
+		for addr in expect:
+			self.assertEqual(tree.search_best(addr).prefix,
+			    expect[addr])
+		# Changes are seen at once, before the table is rebuilt
+		tree.delete("2001:db8:1:2::80/121")
+		tree.delete("::/0")
+		self.assertEqual(tree.search_best("2001:db8:1:2::83").prefix,
+		    "2001:db8:1:2::/64")
+		self.assertEqual(tree.search_best("3000::1"), None)
+		tree.add("2001:db8:1:2::83/128")
+		for i in range(8):
+			self.assertEqual(tree.search_best(
+			    "2001:db8:1:2::83").prefix, "2001:db8:1:2::83/128")
+			self.assertEqual(tree.search_best(
+			    "2001:db8:1:2::84").prefix, "2001:db8:1:2::/64")
+		packed = b"".join([ socket.inet_pton(socket.AF_INET6, a)
+		    for a in expect ])
+		nodes = tree.search_best_many(packed=packed,
+		    family=socket.AF_INET6)
+		self.assertEqual([ n and n.prefix for n in nodes ],
+		    [ tree.search_best(a) and tree.search_best(a).prefix
+		    for a in expect ])
+		tree.compile(False)
+		self.assertEqual(tree.search_best("2001:db8:1:6::1").prefix,
+		    "2001:db8:1:6::/63")
+
+	def test_34__search_covered(self):
+		tree = radix.Radix()
+		prefixes = [ "10.0.0.0/8", "10.1.0.0/16", "10.1.2.0/24",
+		    "10.1.3.0/24", "10.1.3.128/25", "10.2.0.0/16",
+		    "11.0.0.0/8", "2001:db8::/32", "2001:db8:1::/48" ]
+		for prefix in prefixes:
+			tree.add(prefix)
+		def covered(*args, **kw_args):
+			return [ n.prefix for n in tree.search_covered(*args,
+			    **kw_args) ]
+		self.assertEqual(covered("10.1.0.0/16"), [ "10.1.0.0/16",
+		    "10.1.2.0/24", "10.1.3.0/24", "10.1.3.128/25" ])
+		self.assertEqual(covered("10.1.3.0/24"), [ "10.1.3.0/24",
+		    "10.1.3.128/25" ])
+		self.assertEqual(covered("10.0.0.0/8"), prefixes[:6])
+		self.assertEqual(covered("10.0.0.0/7"), prefixes[:7])
+		self.assertEqual(covered("0.0.0.0/0"), prefixes[:7])
+		self.assertEqual(covered("10.1.0.0", 20), [ "10.1.2.0/24",
+		    "10.1.3.0/24", "10.1.3.128/25" ])
+		self.assertEqual(covered("10.1.3.129"), [])
+		self.assertEqual(covered("10.3.0.0/16"), [])
+		self.assertEqual(covered("12.0.0.0/8"), [])
+		self.assertEqual(covered("2001:db8::/31"), prefixes[7:])
+		self.assertEqual(covered(packed = b"\x0a\x01\x03\x80",
+		    masklen = 25), [ "10.1.3.128/25" ])
+		tree.delete("10.1.3.0/24")
+		self.assertEqual(covered("10.1.3.0/24"), [ "10.1.3.128/25" ])
+		self.assertEqual(radix.Radix().search_covered("10.0.0.0/8"), [])
+
+	def test_35__search_covering(self):
+		tree = radix.Radix()
+		prefixes = [ "0.0.0.0/0", "10.0.0.0/8", "10.1.0.0/16",
+		    "10.1.2.0/24", "10.1.2.128/25", "10.1.3.0/24",
+		    "2001:db8::/32", "2001:db8:1::/48" ]
+		for prefix in prefixes:
+			tree.add(prefix)
+		def covering(*args, **kw_args):
+			return [ n.prefix for n in tree.search_covering(*args,
+			    **kw_args) ]
+		self.assertEqual(covering("10.1.2.129"), [ "10.1.2.128/25",
+		    "10.1.2.0/24", "10.1.0.0/16", "10.0.0.0/8", "0.0.0.0/0" ])
+		self.assertEqual(covering("10.1.2.0/24"), [ "10.1.2.0/24",
+		    "10.1.0.0/16", "10.0.0.0/8", "0.0.0.0/0" ])
+		self.assertEqual(covering("10.1.2.0/24", inclusive = False),
+		    [ "10.1.0.0/16", "10.0.0.0/8", "0.0.0.0/0" ])
+		self.assertEqual(covering("10.1.2.0", 23), [ "10.1.0.0/16",
+		    "10.0.0.0/8", "0.0.0.0/0" ])
+		self.assertEqual(covering("11.0.0.1"), [ "0.0.0.0/0" ])
+		self.assertEqual(covering("0.0.0.0/0", inclusive = False), [])
+		self.assertEqual(covering("2001:db8:1:2::1"),
+		    [ "2001:db8:1::/48", "2001:db8::/32" ])
+		self.assertEqual(covering("2001:db9::1"), [])
+		self.assertEqual(covering(packed = b"\x0a\x01\x03\x01"),
+		    [ "10.1.3.0/24", "10.1.0.0/16", "10.0.0.0/8",
+		    "0.0.0.0/0" ])
+		tree.delete("10.1.0.0/16")
+		self.assertEqual(covering("10.1.2.1"), [ "10.1.2.0/24",
+		    "10.0.0.0/8", "0.0.0.0/0" ])
+		self.assertEqual(covering("10.1.2.1")[0],
+		    tree.search_best("10.1.2.1").prefix)
+
+	def test_36__iter_nodes(self):
+		tree = radix.Radix()
+		prefixes = [ "10.0.0.0/8", "10.1.0.0/16", "10.1.2.0/24",
+		    "11.0.0.0/8", "2001:db8::/32", "2001:db8:1::/48" ]
+		for prefix in prefixes:
+			tree.add(prefix)
+		self.assertEqual(tree.prefixes(), prefixes)
+		self.assertEqual([ n.prefix for n in tree.nodes() ], prefixes)
+		self.assertEqual(list(tree.iter_prefixes()), prefixes)
+		self.assertEqual([ n.prefix for n in tree.iter_nodes() ],
+		    prefixes)
+		self.assertEqual(list(tree.iter_prefixes(family =
+		    socket.AF_INET)), prefixes[:4])
+		self.assertEqual(list(tree.iter_prefixes(family =
+		    socket.AF_INET6)), prefixes[4:])
+		self.assertEqual(list(tree.iter_prefixes("10.1.0.0/16")),
+		    prefixes[1:3])
+		self.assertEqual([ n.prefix for n in
+		    tree.iter_nodes("2001:db8::/16") ], prefixes[4:])
+		self.assertEqual(list(tree.iter_prefixes("12.0.0.0/8")), [])
+		self.assertRaises(ValueError, tree.iter_nodes, "10.0.0.0/8",
+		    family = socket.AF_INET6)
+		it = tree.iter_nodes()
+		self.assertTrue(iter(it) is it)
+		next(it)
+		tree.delete("11.0.0.0/8")
+		self.assertRaises(RuntimeWarning, next, it)
+		del prefixes[3]
+		self.assertEqual(tree.prefixes(), prefixes)
+		self.assertEqual(list(radix.Radix().iter_prefixes()), [])
+
+	def test_37__len_stats(self):
+		tree = radix.Radix()
+		self.assertEqual(len(tree), 0)
+		stats = tree.stats()
+		for key in [ "prefixes4", "prefixes6", "nodes4", "nodes6",
+		    "glue4", "glue6" ]:
+			self.assertEqual(stats[key], 0)
+		for prefix in [ "10.0.0.0/24", "10.0.1.0/24", "10.0.0.0/8",
+		    "2001:db8::/32" ]:
+			tree.add(prefix)
+		tree.add("10.0.0.0/8")
+		self.assertEqual(len(tree), 4)
+		stats = tree.stats()
+		self.assertEqual(stats["prefixes4"], 3)
+		self.assertEqual(stats["prefixes6"], 1)
+		self.assertEqual(stats["glue4"], 1)
+		self.assertEqual(stats["nodes4"], 4)
+		tree.delete("10.0.0.0/8")
+		tree.delete("2001:db8::/32")
+		self.assertEqual(len(tree), 2)
+		self.assertEqual(tree.stats()["prefixes6"], 0)
+		tree.add_many([ "192.168.%d.0/24" % i for i in range(10) ])
+		self.assertEqual(len(tree), 12)
+		self.assertEqual(len(pickle.loads(pickle.dumps(tree))), 12)
+		self.assertEqual(len(tree), len(tree.prefixes()))
+
+	def test_38__stats_detail(self):
+		tree = radix.Radix()
+		empty = tree.stats(detail = True)
+		self.assertEqual(empty["depths4"], [])
+		for prefix in [ "10.0.0.0/8", "10.0.0.0/24", "10.0.1.0/24",
+		    "10.1.0.0/16", "2001:db8::/32" ]:
+			tree.add(prefix)
+		stats = tree.stats(detail = True)
+		# 10/8 -> glue -> { glue -> { 10.0.0/24, 10.0.1/24 }, 10.1/16 }
+		self.assertEqual(stats["depths4"], [ 1, 0, 1, 2 ])
+		self.assertEqual(stats["depths6"], [ 1 ])
+		self.assertEqual(sum(stats["depths4"]), stats["prefixes4"])
+		self.assertTrue(stats["memory4"] > empty["memory4"])
+		self.assertFalse("depths4" in tree.stats())
+		if "lookups4" in stats:
+			self.assertEqual(stats["lookups4"], 4)
+			tree.search_best("10.0.1.1")
+			self.assertEqual(tree.stats()["best_searches4"], 1)
+
+	def test_39__mapping(self):
+		tree = radix.Radix(mapping = True)
+		tree["10.0.0.0/8"] = "a"
+		tree["10.1.0.0/16"] = [ 1 ]
+		tree["2001:db8::/32"] = None
+		self.assertEqual(len(tree), 3)
+		self.assertEqual(tree["10.1.2.3"], [ 1 ])
+		self.assertEqual(tree["10.2.0.0/16"], "a")
+		self.assertEqual(tree["2001:db8::1"], None)
+		self.assertRaises(KeyError, lambda: tree["11.0.0.1"])
+		self.assertTrue("10.2.3.4" in tree)
+		self.assertFalse("11.0.0.1" in tree)
+		self.assertEqual(tree.get("10.1.2.3", exact = True), None)
+		self.assertEqual(tree.get("10.1.0.0/16", exact = True), [ 1 ])
+		self.assertEqual(tree.get("11.0.0.1", 7), 7)
+		self.assertEqual(tree.search_best_many([ "10.1.0.1", "11.0.0.1" ]),
+		    [ [ 1 ], None ])
+		# Replacing a value doesn't add a prefix or stop an iteration
+		for prefix in tree:
+			tree[prefix] = prefix
+		self.assertEqual(len(tree), 3)
+		self.assertEqual(list(tree), tree.prefixes())
+		self.assertEqual(tree["10.1.2.3"], "10.1.0.0/16")
+		del tree["10.1.0.0/16"]
+		self.assertEqual(tree["10.1.2.3"], "10.0.0.0/8")
+		self.assertRaises(KeyError, tree.__delitem__, "10.1.0.0/16")
+		tree.delete("10.0.0.0/8")
+		self.assertEqual(tree.prefixes(), [ "2001:db8::/32" ])
+		self.assertRaises(ValueError, lambda: tree["blah"])
+		self.assertRaises(TypeError, tree.add, "10.0.0.0/8")
+		self.assertRaises(TypeError, tree.search_best, "10.0.0.1")
+		self.assertRaises(TypeError, tree.nodes)
+		self.assertRaises(TypeError, tree.freeze)
+		tree["10.0.0.0/8"] = { "x": 1 }
+		tree2 = pickle.loads(pickle.dumps(tree))
+		self.assertEqual(tree2["10.0.0.1"], { "x": 1 })
+		self.assertEqual(tree2.prefixes(), tree.prefixes())
+		self.assertRaises(TypeError, lambda: radix.Radix()["10.0.0.1"])
+
+	def test_40__intradix(self):
+		tree = radix.IntRadix()
+		tree["10.0.0.0/8"] = 0
+		tree["10.1.0.0/16"] = 65000
+		tree["2001:db8::/32"] = 2 ** 32
+		self.assertEqual(len(tree), 3)
+		self.assertEqual(tree["10.2.0.1"], 0)
+		self.assertEqual(tree["10.1.0.1"], 65000)
+		self.assertEqual(tree["2001:db8::1"], 2 ** 32)
+		self.assertTrue("10.2.0.1" in tree)
+		self.assertFalse("11.0.0.1" in tree)
+		self.assertEqual(tree.get("10.1.0.1", exact = True), None)
+		self.assertEqual(list(tree), [ "10.0.0.0/8", "10.1.0.0/16",
+		    "2001:db8::/32" ])
+		self.assertRaises(OverflowError, tree.__setitem__, "1.0.0.0/8", -1)
+		self.assertRaises(TypeError, tree.__setitem__, "1.0.0.0/8", "x")
+		tree.add_many([ ("192.168.0.0/16", 1), ("192.168.1.0/24", 2) ])
+		tree.add_many(packed = socket.inet_aton("192.0.2.1") +
+		    socket.inet_aton("192.0.2.2"), values = [ 3, 4 ])
+		self.assertEqual(tree["192.0.2.2"], 4)
+		import ctypes
+		addrs = [ "10.0.0.1", "11.0.0.1", "10.1.0.1", "192.168.1.1" ]
+		self.assertEqual(tree.search_best_many(addrs),
+		    [ 0, None, 65000, 2 ])
+		out = (ctypes.c_int32 * len(addrs))()
+		packed = b"".join([ socket.inet_aton(a) for a in addrs ])
+		self.assertEqual(tree.search_best_into(packed, out,
+		    result = "value"), 3)
+		self.assertEqual(list(out), [ 0, -1, 65000, 2 ])
+		self.assertRaises(ValueError, tree.search_best_into, packed, out,
+		    result = "tag")
+		frozen = radix.FrozenRadix(tree.freeze())
+		self.assertEqual(frozen.search_best("10.1.0.1").tag, 65000)
+		tree2 = pickle.loads(pickle.dumps(tree))
+		self.assertEqual(tree2.prefixes(), tree.prefixes())
+		self.assertEqual(tree2["2001:db8::1"], 2 ** 32)
+		del tree["10.1.0.0/16"]
+		self.assertEqual(tree["10.1.0.1"], 0)
+		self.assertRaises(TypeError, tree.add, "10.0.0.0/8")
+
+	def test_47__intradix_merge_state(self):
+		tree = radix.IntRadix()
+		tree["10.0.0.0/8"] = 1
+		tree["2001:db8::/32"] = 2
+		tree2 = radix.IntRadix()
+		tree2["192.168.0.0/16"] = 7
+		tree2["10.0.0.0/8"] = 3
+		tree2.__setstate__(tree.__reduce__()[2])
+		self.assertEqual(tree2.prefixes(), [ "10.0.0.0/8",
+		    "192.168.0.0/16", "2001:db8::/32" ])
+		self.assertEqual(tree2["10.0.0.1"], 1)
+		self.assertEqual(tree2["192.168.1.1"], 7)
+		self.assertEqual(tree2["2001:db8::1"], 2)
+
+	def test_41__copy(self):
+		import copy
+		tree = radix.Radix()
+		for prefix in [ "10.0.0.0/8", "10.1.0.0/16", "10.2.0.0/16",
+		    "2001:db8::/32" ]:
+			node = tree.add(prefix)
+			node.data["list"] = [ prefix ]
+		tree.search_exact("10.1.0.0/16").tag = 7
+		tree2 = tree.copy()
+		self.assertEqual(tree2.prefixes(), tree.prefixes())
+		self.assertEqual(len(tree2), len(tree))
+		node = tree.search_best("10.1.2.3")
+		node2 = tree2.search_best("10.1.2.3")
+		self.assertNotEqual(node, node2)
+		self.assertEqual(node2.tag, 7)
+		self.assertEqual(node2.data, node.data)
+		self.assertFalse(node2.data is node.data)
+		self.assertTrue(node2.data["list"] is node.data["list"])
+		tree2.delete("10.1.0.0/16")
+		self.assertEqual(tree2.search_best("10.1.2.3").prefix, "10.0.0.0/8")
+		self.assertEqual(tree.search_best("10.1.2.3"), node)
+		node2 = copy.deepcopy(tree).search_best("10.1.2.3")
+		self.assertEqual(node2.data["list"], node.data["list"])
+		self.assertFalse(node2.data["list"] is node.data["list"])
+		self.assertEqual(copy.copy(tree).prefixes(), tree.prefixes())
+		mapping = radix.Radix(mapping = True)
+		mapping["10.0.0.0/8"] = [ 1 ]
+		self.assertTrue(mapping.copy()["10.0.0.1"] is mapping["10.0.0.1"])
+		deep = mapping.copy(deep = True)
+		self.assertEqual(deep["10.0.0.1"], [ 1 ])
+		self.assertFalse(deep["10.0.0.1"] is mapping["10.0.0.1"])
+		ints = radix.IntRadix()
+		ints["10.0.0.0/8"] = 0
+		ints["::/0"] = 2
+		ints2 = ints.copy()
+		self.assertEqual(ints2.prefixes(), ints.prefixes())
+		self.assertEqual(ints2["10.0.0.1"], 0)
+		self.assertEqual(ints2["::1"], 2)
+
+	def test_45__copy_while_changing(self):
+		import copy
+		tree = radix.Radix(mapping = True)
+		class Changer(object):
+			def __deepcopy__(self, memo):
+				for i in range(256):
+					del tree["10.%d.0.0/16" % i]
+				return self
+		for i in range(256):
+			tree["10.%d.0.0/16" % i] = i
+		tree["10.0.0.0/8"] = Changer()
+		tree2 = copy.deepcopy(tree)
+		self.assertEqual(len(tree), 1)
+		self.assertEqual(len(tree2), 257)
+		self.assertEqual(tree2["10.255.0.1"], 255)
+
+	def test_42__snapshot(self):
+		tree = radix.Radix()
+		node = tree.add("10.0.0.0/8")
+		tree.add("2001:db8::/32")
+		snap = tree.snapshot()
+		self.assertTrue(snap.snapshot() is snap)
+		tree.add("10.1.0.0/16")
+		tree.delete("10.0.0.0/8")
+		self.assertEqual(snap.prefixes(), [ "10.0.0.0/8", "2001:db8::/32" ])
+		self.assertEqual(snap.search_best("10.1.0.1"), node)
+		self.assertEqual(tree.search_best("10.2.0.1"), None)
+		self.assertEqual(len(snap), 2)
+		self.assertRaises(TypeError, snap.add, "11.0.0.0/8")
+		self.assertRaises(TypeError, snap.delete, "10.0.0.0/8")
+		self.assertEqual(snap.copy().add("11.0.0.0/8").prefix, "11.0.0.0/8")
+		# Iterating over a snapshot survives changes to the tree
+		snap2 = tree.snapshot()
+		prefixes = []
+		for node in snap2:
+			prefixes.append(node.prefix)
+			tree.add("12.0.0.0/8")
+			tree.delete("12.0.0.0/8")
+		self.assertEqual(prefixes, [ "10.1.0.0/16", "2001:db8::/32" ])
+		mapping = radix.Radix(mapping = True)
+		mapping["10.0.0.0/8"] = 1
+		snap = mapping.snapshot()
+		mapping["10.0.0.0/8"] = 2
+		self.assertEqual(snap["10.0.0.1"], 1)
+		self.assertEqual(mapping["10.0.0.1"], 2)
+		def assign():
+			snap["10.0.0.0/8"] = 3
+		self.assertRaises(TypeError, assign)
+
+	def test_48__concurrent_snapshot(self):
+		import threading
+		tree = radix.Radix()
+		tree.add("10.0.0.0/8")
+		packed = socket.inet_aton("10.1.2.3") * 100000
+		stop = []
+		def reader():
+			while not stop:
+				tree.search_best_many(packed = packed)
+		def writer():
+			for i in range(2000):
+				tree.add("11.%d.%d.0/24" % (i // 256, i % 256))
+		readers = [threading.Thread(target = reader) for i in range(3)]
+		for t in readers:
+			t.start()
+		w = threading.Thread(target = writer)
+		w.start()
+		snaps = []
+		while w.is_alive():
+			snap = tree.snapshot()
+			snaps.append((snap, snap.prefixes()))
+		w.join()
+		stop.append(True)
+		for t in readers:
+			t.join()
+		changed = [s for s, prefixes in snaps if s.prefixes() != prefixes]
+		self.assertEqual(changed, [])
+
+	def test_43__update(self):
+		tree = radix.Radix()
+		node = tree.add("10.0.0.0/8")
+		tree.add("11.0.0.0/8")
+		self.assertEqual(tree.update(adds = [ "12.0.0.0/8",
+		    ("2001:db8::/32", { "a": 1 }) ],
+		    deletes = [ "11.0.0.0/8", "13.0.0.0/8" ]), (3, 1))
+		self.assertEqual(tree.prefixes(),
+		    [ "10.0.0.0/8", "12.0.0.0/8", "2001:db8::/32" ])
+		self.assertEqual(tree.search_exact("2001:db8::/32").data["a"], 1)
+		self.assertEqual(tree.search_best("10.0.0.1"), node)
+		# Deletes go first, and a bad network leaves the tree alone
+		self.assertEqual(tree.update([ "10.0.0.0/8" ], [ "10.0.0.0/8" ]),
+		    (2, 0))
+		self.assertEqual(node.prefix, "10.0.0.0/8")
+		self.assertNotEqual(tree.search_exact("10.0.0.0/8"), node)
+		self.assertRaises(ValueError, tree.update, [ "14.0.0.0/8" ],
+		    [ "12.0.0.0/8", "bogus" ])
+		self.assertEqual(len(tree), 3)
+		self.assertEqual(tree.update(), (0, 0))
+		self.assertRaises(TypeError, tree.snapshot().update)
+		mapping = radix.Radix(mapping = True)
+		mapping["10.0.0.0/8"] = 1
+		self.assertEqual(mapping.update({ "10.0.0.0/8": 2, "::/0": 3 },
+		    [ "11.0.0.0/8" ]), (2, 1))
+		self.assertEqual(mapping["10.1.1.1"], 2)
+		self.assertEqual(mapping["2001::1"], 3)
+		self.assertRaises(TypeError, mapping.update, [ "10.0.0.0/8" ])
+		tree = radix.IntRadix()
+		self.assertEqual(tree.update([ ("10.0.0.0/8", 1),
+		    ("10.0.0.0/8", 2), ("9.0.0.0/8", 3) ]), (3, 0))
+		self.assertEqual(tree["10.0.0.1"], 2)
+		self.assertEqual(tree["9.0.0.1"], 3)
+
 def main():
 	unittest.main()
 